@@ -0,0 +1,160 @@
+// Throughput of the hash functions of hash.h, and the ht_get rate of a
+// table using each, by key length.
+//
+// Build and run from the repository root:
+//   cc -O2 -pthread -I. bench/hash_bench.c ht.c hash.c thpool.c -o hash_bench
+//   ./hash_bench [keys] [seconds per measurement]
+//
+// Defaults: 262144 keys, 0.5 seconds. Keys of each length are distinct
+// random printable strings; lookups visit them in a shuffled order.
+
+#include "hash.h"
+#include "ht.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static const size_t key_lengths[] = {8, 16, 32, 64, 128, 256};
+
+static const struct {
+  const char* name;
+  hash_function fn;
+} hashes[] = {
+  {"fnv1a", hash_fnv1a},
+  {"wyhash", hash_wyhash},
+  {"siphash13", hash_siphash13},
+};
+
+#define NLENGTHS (sizeof(key_lengths) / sizeof(key_lengths[0]))
+#define NHASHES (sizeof(hashes) / sizeof(hashes[0]))
+
+static double now_s(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static uint64_t next_random(uint64_t* state) {
+  uint64_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  return *state = x;
+}
+
+// Keep results alive, so the compiler can't drop the work.
+static volatile uint64_t sink;
+
+// Return nanoseconds per hash of n keys of len bytes, hashing them over
+// and over for about seconds.
+static double time_hash(hash_function fn, char** keys, size_t n, size_t len,
+    double seconds) {
+  uint64_t sum = 0, count = 0;
+  double start = now_s(), elapsed;
+  do {
+    for (size_t i = 0; i < n; i++) {
+      sum += fn(keys[i], len, 0);
+    }
+    count += n;
+  } while ((elapsed = now_s() - start) < seconds);
+  sink = sum;
+  return elapsed * 1e9 / (double)count;
+}
+
+// Return millions of ht_get per second on a table hashing with fn and
+// holding the n keys, looked up in the order of order.
+static double time_get(hash_function fn, char** keys, const size_t* order,
+    size_t n, double seconds) {
+  ht* table = ht_create_with_hash(1, fn);
+  if (table == NULL) {
+    return 0;
+  }
+  for (size_t i = 0; i < n; i++) {
+    if (ht_set(table, keys[i], keys[i]) != 0) {
+      ht_destroy(table);
+      return 0;
+    }
+  }
+  uint64_t count = 0;
+  double start = now_s(), elapsed;
+  do {
+    for (size_t i = 0; i < n; i++) {
+      if (ht_get(table, keys[order[i]]) != keys[order[i]]) {
+        abort();
+      }
+    }
+    count += n;
+  } while ((elapsed = now_s() - start) < seconds);
+  ht_destroy(table);
+  return (double)count / elapsed / 1e6;
+}
+
+int main(int argc, char** argv) {
+  size_t n = argc > 1 ? (size_t)atol(argv[1]) : 1 << 18;
+  double seconds = argc > 2 ? atof(argv[2]) : 0.5;
+  uint64_t seed = 0x9e3779b97f4a7c15ULL;
+
+  char** keys = malloc(n * sizeof(char*));
+  size_t* order = malloc(n * sizeof(size_t));
+  if (keys == NULL || order == NULL) {
+    return 1;
+  }
+  for (size_t i = 0; i < n; i++) {
+    order[i] = i;
+  }
+  for (size_t i = n; i > 1; i--) {
+    size_t j = next_random(&seed) % i;
+    size_t t = order[i - 1];
+    order[i - 1] = order[j];
+    order[j] = t;
+  }
+
+  printf("%zu keys; hash ns/key (GB/s), ht_get Mops/s\n", n);
+  printf("%4s", "len");
+  for (size_t h = 0; h < NHASHES; h++) {
+    printf("  %18s", hashes[h].name);
+  }
+  for (size_t h = 0; h < NHASHES; h++) {
+    printf("  %9s", hashes[h].name);
+  }
+  printf("\n");
+
+  for (size_t l = 0; l < NLENGTHS; l++) {
+    size_t len = key_lengths[l];
+    // Random printable bytes, with the index up front to keep them unique.
+    for (size_t i = 0; i < n; i++) {
+      keys[i] = malloc(len + 1);
+      if (keys[i] == NULL) {
+        return 1;
+      }
+      for (size_t k = 0; k < len; k++) {
+        keys[i][k] = (char)('!' + next_random(&seed) % 94);
+      }
+      keys[i][len] = '\0';
+      char index[24];
+      int w = snprintf(index, sizeof(index), "%zx", i);
+      memcpy(keys[i], index, (size_t)w < len ? (size_t)w : len);
+    }
+
+    printf("%4zu", len);
+    for (size_t h = 0; h < NHASHES; h++) {
+      double ns = time_hash(hashes[h].fn, keys, n, len, seconds);
+      printf("  %8.2f (%6.2f)", ns, (double)len / ns);
+    }
+    for (size_t h = 0; h < NHASHES; h++) {
+      printf("  %9.2f", time_get(hashes[h].fn, keys, order, n, seconds));
+    }
+    printf("\n");
+    fflush(stdout);
+
+    for (size_t i = 0; i < n; i++) {
+      free(keys[i]);
+    }
+  }
+  free(order);
+  free(keys);
+  return 0;
+}
@@ -0,0 +1,145 @@
+// Throughput of ht under concurrent lookups and inserts, by thread count,
+// for a single-shard table (one lock) against a sharded one.
+//
+// Build and run from the repository root:
+//   cc -O2 -pthread -I. bench/ht_bench.c ht.c hash.c thpool.c -o ht_bench
+//   ./ht_bench [seconds per run] [percent of ops that are sets] [shards]
+//
+// Defaults: 1 second, 10% sets, 64 shards. Threads pick keys uniformly
+// from a preloaded key set, so sets mostly overwrite existing items.
+
+#include "ht.h"
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+
+#define NKEYS (1 << 20)
+#define MAX_THREADS 64
+
+static char** keys;
+static atomic_bool stop;
+
+typedef struct {
+  ht* table;
+  unsigned write_percent;
+  uint64_t seed;
+  uint64_t ops;  // done by this thread
+} bench_thread;
+
+static double now_s(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+// xorshift64: cheap enough not to show up in the measurement.
+static inline uint64_t next_random(uint64_t* state) {
+  uint64_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  return *state = x;
+}
+
+static void* run(void* arg) {
+  bench_thread* t = arg;
+  uint64_t ops = 0;
+  while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+    // Check the clock's flag only every 256 ops.
+    for (int k = 0; k < 256; k++) {
+      uint64_t r = next_random(&t->seed);
+      const char* key = keys[r % NKEYS];
+      if ((r >> 32) % 100 < t->write_percent) {
+        ht_set(t->table, key, (void*)key);
+      } else if (ht_get(t->table, key) == NULL) {
+        abort();
+      }
+    }
+    ops += 256;
+  }
+  t->ops = ops;
+  return NULL;
+}
+
+// Return ops per second of nthreads threads on table for seconds.
+static double measure(ht* table, int nthreads, double seconds,
+    unsigned write_percent) {
+  pthread_t threads[MAX_THREADS];
+  bench_thread args[MAX_THREADS];
+  atomic_store(&stop, false);
+  double start = now_s();
+  for (int i = 0; i < nthreads; i++) {
+    args[i] = (bench_thread){table, write_percent,
+      0x9e3779b97f4a7c15ULL * (uint64_t)(i + 1), 0};
+    pthread_create(&threads[i], NULL, run, &args[i]);
+  }
+  struct timespec ts = {(time_t)seconds,
+    (long)((seconds - (double)(time_t)seconds) * 1e9)};
+  nanosleep(&ts, NULL);
+  atomic_store(&stop, true);
+  uint64_t ops = 0;
+  for (int i = 0; i < nthreads; i++) {
+    pthread_join(threads[i], NULL);
+    ops += args[i].ops;
+  }
+  return (double)ops / (now_s() - start);
+}
+
+// Return table of given shard count holding every key.
+static ht* load(size_t nshards) {
+  ht* table = nshards == 1 ? ht_create() : ht_create_sharded(nshards);
+  if (table == NULL) {
+    return NULL;
+  }
+  for (size_t i = 0; i < NKEYS; i++) {
+    if (ht_set(table, keys[i], keys[i]) != 0) {
+      ht_destroy(table);
+      return NULL;
+    }
+  }
+  return table;
+}
+
+int main(int argc, char** argv) {
+  double seconds = argc > 1 ? atof(argv[1]) : 1.0;
+  unsigned write_percent = argc > 2 ? (unsigned)atoi(argv[2]) : 10;
+  size_t nshards = argc > 3 ? (size_t)atol(argv[3]) : 64;
+
+  keys = malloc(NKEYS * sizeof(char*));
+  if (keys == NULL) {
+    return 1;
+  }
+  for (size_t i = 0; i < NKEYS; i++) {
+    keys[i] = malloc(24);
+    if (keys[i] == NULL) {
+      return 1;
+    }
+    snprintf(keys[i], 24, "key-%zu", i);
+  }
+  ht* single = load(1);
+  ht* sharded = load(nshards);
+  if (single == NULL || sharded == NULL) {
+    fprintf(stderr, "out of memory\n");
+    return 1;
+  }
+
+  printf("%u%% sets, %d keys, Mops/s\n", write_percent, NKEYS);
+  printf("threads  1 shard  %zu shards\n", nshards);
+  for (int n = 1; n <= MAX_THREADS; n *= 2) {
+    double a = measure(single, n, seconds, write_percent);
+    double b = measure(sharded, n, seconds, write_percent);
+    printf("%7d  %7.2f  %9.2f\n", n, a / 1e6, b / 1e6);
+  }
+
+  ht_destroy(single);
+  ht_destroy(sharded);
+  for (size_t i = 0; i < NKEYS; i++) {
+    free(keys[i]);
+  }
+  free(keys);
+  return 0;
+}
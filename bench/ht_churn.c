@@ -0,0 +1,120 @@
+// Probe lengths and memory of ht under insert/remove churn, over time.
+//
+// Build and run from the repository root:
+//   cc -O2 -pthread -I. bench/ht_churn.c ht.c hash.c thpool.c -o ht_churn
+//   ./ht_churn [live keys] [intervals] [ops per interval]
+//
+// Defaults: 1M live keys, 20 intervals, 1M ops each. Fills the table,
+// then churns it: each op removes the oldest key and inserts a new one,
+// so the live count stays put while every key is eventually replaced.
+// Finally drains it to 1/16 of the live keys, to show memory following.
+// After each interval, prints ht_stats probe lengths and the process's
+// resident memory (RSS, from /proc/self/statm; "-" where unavailable).
+
+#include "ht.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+static double now_s(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+// Return resident memory in MiB, or -1 if unknown.
+static double rss_mib(void) {
+  FILE* f = fopen("/proc/self/statm", "r");
+  if (f == NULL) {
+    return -1;
+  }
+  unsigned long size, resident;
+  int n = fscanf(f, "%lu %lu", &size, &resident);
+  fclose(f);
+  if (n != 2) {
+    return -1;
+  }
+  return (double)resident * (double)sysconf(_SC_PAGESIZE) / (1 << 20);
+}
+
+static void key_of(char* buf, size_t size, uint64_t id) {
+  snprintf(buf, size, "churn-key-%llu", (unsigned long long)id);
+}
+
+static void report(ht* table, const char* phase, uint64_t ops,
+    double seconds) {
+  hts stats;
+  ht_stats(table, &stats);
+  double rss = rss_mib();
+  printf("%-6s %10llu %9zu %9zu %8zu %6.2f %5zu %6.2f ",
+    phase, (unsigned long long)ops, stats.length, stats.capacity,
+    stats.deleted, stats.mean_probe, stats.max_probe,
+    seconds > 0 ? (double)ops / seconds / 1e6 : 0.0);
+  if (rss >= 0) {
+    printf("%8.1f\n", rss);
+  } else {
+    printf("%8s\n", "-");
+  }
+  fflush(stdout);
+}
+
+int main(int argc, char** argv) {
+  uint64_t live = argc > 1 ? strtoull(argv[1], NULL, 10) : 1 << 20;
+  int intervals = argc > 2 ? atoi(argv[2]) : 20;
+  uint64_t ops = argc > 3 ? strtoull(argv[3], NULL, 10) : 1 << 20;
+  static char value[] = "v";
+  char key[32];
+
+  ht* table = ht_create();
+  if (table == NULL) {
+    return 1;
+  }
+  printf("phase         ops    length  capacity  deleted  mean   max  Mops/s"
+    "  RSS MiB\n");
+  report(table, "start", 0, 0);
+
+  // Keys oldest..newest-1 are live.
+  uint64_t oldest = 0, newest = 0;
+  double start = now_s();
+  for (; newest < live; newest++) {
+    key_of(key, sizeof(key), newest);
+    if (ht_set(table, key, value) != 0) {
+      return 1;
+    }
+  }
+  report(table, "fill", live, now_s() - start);
+
+  for (int i = 0; i < intervals; i++) {
+    start = now_s();
+    for (uint64_t k = 0; k < ops; k++) {
+      key_of(key, sizeof(key), oldest++);
+      if (ht_remove(table, key) != 0) {
+        return 1;
+      }
+      key_of(key, sizeof(key), newest++);
+      if (ht_set(table, key, value) != 0) {
+        return 1;
+      }
+    }
+    report(table, "churn", ops, now_s() - start);
+  }
+
+  // Drain in four steps down to a sixteenth of the live keys.
+  uint64_t step = (live - live / 16) / 4;
+  for (int i = 0; i < 4; i++) {
+    start = now_s();
+    for (uint64_t k = 0; k < step; k++) {
+      key_of(key, sizeof(key), oldest++);
+      if (ht_remove(table, key) != 0) {
+        return 1;
+      }
+    }
+    report(table, "drain", step, now_s() - start);
+  }
+
+  ht_destroy(table);
+  return 0;
+}
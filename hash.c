@@ -0,0 +1,178 @@
+// Hash functions shared by ht and SimpleSet.
+
+#include "hash.h"
+
+#include <string.h>
+
+#define FNV_OFFSET 14695981039346656037UL
+#define FNV_PRIME 1099511628211UL
+
+// See description:
+// https://en.wikipedia.org/wiki/Fowler–Noll–Vo_hash_function
+uint64_t hash_fnv1a(const void* key, size_t len, uint64_t seed) {
+  const unsigned char* p = key;
+  uint64_t hash = FNV_OFFSET ^ seed;
+  for (size_t i = 0; i < len; i++) {
+    hash ^= (uint64_t)p[i];
+    hash *= FNV_PRIME;
+  }
+  return hash;
+}
+
+// Secret constants from wyhash (https://github.com/wangyi-fudan/wyhash).
+static const uint64_t wy_secret[4] = {
+  0x2d358dccaa6c78a5ULL, 0x8bb84b93962eacc9ULL,
+  0x4b33a62ed433d4a3ULL, 0x4d5a2da51de1aa47ULL
+};
+
+// Multiply a and b into 128 bits, leaving low half in a, high half in b.
+static inline void wy_mum(uint64_t* a, uint64_t* b) {
+#if defined(__SIZEOF_INT128__)
+  __uint128_t r = (__uint128_t)*a * *b;
+  *a = (uint64_t)r;
+  *b = (uint64_t)(r >> 64);
+#else
+  uint64_t ha = *a >> 32, hb = *b >> 32;
+  uint64_t la = (uint32_t)*a, lb = (uint32_t)*b;
+  uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+  uint64_t t = rl + (rm0 << 32);
+  uint64_t c = t < rl;
+  uint64_t lo = t + (rm1 << 32);
+  c += lo < t;
+  *a = lo;
+  *b = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+#endif
+}
+
+static inline uint64_t wy_mix(uint64_t a, uint64_t b) {
+  wy_mum(&a, &b);
+  return a ^ b;
+}
+
+// Unaligned native-endian loads; memcpy compiles to a single load.
+static inline uint64_t wy_r8(const unsigned char* p) {
+  uint64_t v;
+  memcpy(&v, p, 8);
+  return v;
+}
+
+static inline uint64_t wy_r4(const unsigned char* p) {
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return v;
+}
+
+// Read 1 to 3 bytes.
+static inline uint64_t wy_r3(const unsigned char* p, size_t k) {
+  return ((uint64_t)p[0] << 16) | ((uint64_t)p[k >> 1] << 8) | p[k - 1];
+}
+
+uint64_t hash_wyhash(const void* key, size_t len, uint64_t seed) {
+  const unsigned char* p = key;
+  uint64_t a, b;
+  seed ^= wy_mix(seed ^ wy_secret[0], wy_secret[1]);
+
+  if (len <= 16) {
+    // Short keys: two (possibly overlapping) reads cover every byte.
+    if (len >= 4) {
+      a = (wy_r4(p) << 32) | wy_r4(p + ((len >> 3) << 2));
+      b = (wy_r4(p + len - 4) << 32) | wy_r4(p + len - 4 - ((len >> 3) << 2));
+    } else if (len > 0) {
+      a = wy_r3(p, len);
+      b = 0;
+    } else {
+      a = b = 0;
+    }
+  } else {
+    size_t i = len;
+    if (i > 48) {
+      // Three independent lanes of 16 bytes keep the multipliers busy.
+      uint64_t see1 = seed, see2 = seed;
+      do {
+        seed = wy_mix(wy_r8(p) ^ wy_secret[1], wy_r8(p + 8) ^ seed);
+        see1 = wy_mix(wy_r8(p + 16) ^ wy_secret[2], wy_r8(p + 24) ^ see1);
+        see2 = wy_mix(wy_r8(p + 32) ^ wy_secret[3], wy_r8(p + 40) ^ see2);
+        p += 48;
+        i -= 48;
+      } while (i > 48);
+      seed ^= see1 ^ see2;
+    }
+    while (i > 16) {
+      seed = wy_mix(wy_r8(p) ^ wy_secret[1], wy_r8(p + 8) ^ seed);
+      p += 16;
+      i -= 16;
+    }
+    // Last 16 bytes, overlapping what was already consumed if need be.
+    a = wy_r8(p + i - 16);
+    b = wy_r8(p + i - 8);
+  }
+  a ^= wy_secret[1];
+  b ^= seed;
+  wy_mum(&a, &b);
+  return wy_mix(a ^ wy_secret[0] ^ len, b ^ wy_secret[1]);
+}
+
+#define SIP_ROTL(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+
+// One SipRound over the state v.
+static inline void sip_round(uint64_t v[4]) {
+  v[0] += v[1];
+  v[1] = SIP_ROTL(v[1], 13);
+  v[1] ^= v[0];
+  v[0] = SIP_ROTL(v[0], 32);
+  v[2] += v[3];
+  v[3] = SIP_ROTL(v[3], 16);
+  v[3] ^= v[2];
+  v[0] += v[3];
+  v[3] = SIP_ROTL(v[3], 21);
+  v[3] ^= v[0];
+  v[2] += v[1];
+  v[1] = SIP_ROTL(v[1], 17);
+  v[1] ^= v[2];
+  v[2] = SIP_ROTL(v[2], 32);
+}
+
+// SipHash with crounds rounds per 8-byte word and drounds to finalise,
+// under the 128-bit key k0, k1 (https://www.aumasson.jp/siphash/).
+static uint64_t sip_hash(const unsigned char* p, size_t len, uint64_t k0,
+    uint64_t k1, int crounds, int drounds) {
+  uint64_t v[4] = {
+    k0 ^ 0x736f6d6570736575ULL, k1 ^ 0x646f72616e646f6dULL,
+    k0 ^ 0x6c7967656e657261ULL, k1 ^ 0x7465646279746573ULL
+  };
+  size_t left = len & 7;
+  const unsigned char* end = p + (len - left);
+  for (; p != end; p += 8) {
+    // Words are little-endian, whatever the host.
+    uint64_t m = wy_r8(p);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    m = __builtin_bswap64(m);
+#endif
+    v[3] ^= m;
+    for (int r = 0; r < crounds; r++) {
+      sip_round(v);
+    }
+    v[0] ^= m;
+  }
+  // Last word: remaining bytes, with the length in the top byte.
+  uint64_t m = (uint64_t)len << 56;
+  for (size_t i = 0; i < left; i++) {
+    m |= (uint64_t)p[i] << (8 * i);
+  }
+  v[3] ^= m;
+  for (int r = 0; r < crounds; r++) {
+    sip_round(v);
+  }
+  v[0] ^= m;
+  v[2] ^= 0xff;
+  for (int r = 0; r < drounds; r++) {
+    sip_round(v);
+  }
+  return v[0] ^ v[1] ^ v[2] ^ v[3];
+}
+
+uint64_t hash_siphash13(const void* key, size_t len, uint64_t seed) {
+  // Stretch the seed into a 128-bit key whose halves differ.
+  return sip_hash(key, len, seed, wy_mix(seed ^ wy_secret[2], wy_secret[3]),
+    1, 3);
+}
@@ -0,0 +1,27 @@
+// Hash functions shared by ht and SimpleSet.
+
+#ifndef _HASH_H
+#define _HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Return 64-bit hash of len bytes at key, varied by seed.
+typedef uint64_t (*hash_function)(const void* key, size_t len, uint64_t seed);
+
+// 64-bit FNV-1a (seed is mixed into the offset basis; 0 gives the
+// standard function). Simple, but one multiply per byte.
+uint64_t hash_fnv1a(const void* key, size_t len, uint64_t seed);
+
+// wyhash-style hash: reads 8 or 16 bytes per step and mixes them with a
+// 64x64->128-bit multiply. Several times faster than FNV-1a for keys over
+// ~16 bytes, with all 64 output bits well mixed. Default for ht and set.
+uint64_t hash_wyhash(const void* key, size_t len, uint64_t seed);
+
+// SipHash-1-3, a keyed hash: with a secret random seed, whoever picks the
+// keys can't tell which ones collide, so can't flood a table with them.
+// Two to three times slower than hash_wyhash, yet faster than FNV-1a
+// beyond short keys. The seed is stretched into SipHash's 128-bit key.
+uint64_t hash_siphash13(const void* key, size_t len, uint64_t seed);
+
+#endif // _HASH_H
@@ -1,242 +1,2133 @@
 // Simple hash table implemented in C.
 
+// clock_gettime, fseeko and getentropy, also under -std=c11.
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE
+#endif
+
 #include "ht.h"
 
 #include <assert.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define INLINE_KEY 28  // keys shorter than this are stored in the entry
 
-// Hash table entry (slot may be filled or empty).
+// Hash table entry (slot may be filled or empty, see ht_array.ctrl).
+// ht_get reads slots without locking: writers fill in the entry before
+// publishing its control byte, and only value changes after that.
 typedef struct {
-  const char* key;  // key is NULL if this slot is empty
-  void* value;
+  _Atomic(void*) value;
+  uint64_t hash;  // full hash placing key: rehash only rereads key bytes
+                  // to reseed
+  uint32_t key_len;  // key may hold NULs, but is also NUL-terminated
+  // Key bytes and NUL if key_len < INLINE_KEY, else pointer to a heap
+  // copy (kept as bytes so the entry packs into 48 bytes).
+  char key[INLINE_KEY];
 } ht_entry;
 
+// Return entry's key bytes, inline or spilled to the heap.
+static inline const char* ht_entry_key(const ht_entry* entry) {
+  if (entry->key_len < INLINE_KEY) {
+    return entry->key;
+  }
+  const char* heap_key;
+  memcpy(&heap_key, entry->key, sizeof(heap_key));
+  return heap_key;
+}
+
+// Fill in entry for key of len bytes, copying the key into it or, if it
+// doesn't fit, to newly allocated memory. Return false if out of memory.
+static bool ht_entry_init(ht_entry* entry, const char* key, size_t len,
+    uint64_t hash) {
+  entry->hash = hash;
+  entry->key_len = (uint32_t)len;
+  if (len < INLINE_KEY) {
+    memcpy(entry->key, key, len);
+    entry->key[len] = '\0';
+    return true;
+  }
+  char* copy = malloc(len + 1);
+  if (copy == NULL) {
+    return false;
+  }
+  memcpy(copy, key, len);
+  copy[len] = '\0';
+  memcpy(entry->key, &copy, sizeof(copy));
+  return true;
+}
+
+// Control bytes, one per slot: probing scans GROUP_WIDTH of them at once
+// and only touches entries whose byte holds the key hash's low 7 bits.
+#define CTRL_EMPTY 0x00    // never used; ends a probe sequence
+#define CTRL_DELETED 0x01  // removed or migrated key
+#define CTRL_FULL 0x80     // | 7 hash bits
+#define GROUP_WIDTH 16
+
+// Slots and entries, published to readers as one pointer. Compact
+// layout, as in CPython's dict: entries are appended to a dense array in
+// insertion order, and each slot holds only a control byte and the
+// entry's position in an index of 1, 2 or 4 bytes. Slots are never
+// reused, so an entry's position is the number of slots used before it.
+// While a shard is being rehashed its entries migrate into next, in
+// order, a bit on every write, so lookups check both arrays.
+typedef struct ht_array {
+  _Atomic(struct ht_array*) next;  // array being migrated to, or NULL
+  size_t capacity;     // number of slots, power of two >= GROUP_WIDTH
+  size_t used;         // entries appended (live, removed or migrated)
+  uint64_t seed;       // 0 if slots are placed by the table's hash, else
+                       // by hash_siphash13 under this seed, see ht_reseed
+  uint8_t* ctrl;       // per slot: control byte
+  void* index;         // per slot: position of its entry
+  unsigned index_size;  // bytes per index element
+  uint8_t* live;       // per entry: not removed or migrated (writers only)
+  // Cache tables only (else NULL), per entry: CLOCK bit, set by readers,
+  // and expiry time in ms of ht_now_ms, or 0 for none.
+  uint8_t* ref;
+  uint64_t* expires;
+  ht_entry entries[];  // capacity / 8 * 7 entries, then the arrays above
+} ht_array;
+
+// Largest number of entries an array of capacity slots holds: it's
+// rehashed before more than 7/8 of its slots are used.
+#define HT_ENTRIES(capacity) ((capacity) / 8 * 7)
+
+#define RETIRE_BATCH 32  // spilled keys to collect before reclaiming
+#define REHASH_STEP 64   // entries migrated per write while rehashing
+#define FLOOD_PROBES 16  // groups past log2(groups) an insert may probe
+                         // before a reseed, see ht_upsert
+
+// Independently locked sub-table; keys are routed to a shard by the top
+// bits of their hash, so operations on different shards never contend.
+// The mutex only serialises writers.
+typedef struct {
+  _Alignas(64) pthread_mutex_t mtx;  // own cache line, no false sharing
+  _Atomic(ht_array*) array;  // current slots (oldest, if rehashing)
+  size_t rehash_index;  // next entry of array to migrate
+  size_t rehash_pos;    // position in array->next it will take
+  size_t length;    // number of items in this shard
+  size_t max_length;  // cache tables: evict to stay within, else 0
+  size_t clock_hand;  // cache tables: next slot for ht_evict to check
+  void* retired[RETIRE_BATCH];  // memory readers may still be using
+  size_t nretired;
+  // Counters for ht_stats, updated under the lock.
+  uint64_t expansions;  // rehashes started
+  uint64_t rehash_ns;   // time spent starting and running them
+  uint64_t locks;       // lock acquisitions
+  uint64_t lock_waits;  // ...that found the lock taken
+  uint64_t reseeds;     // rehashes under a new seed, see ht_reseed
+} ht_shard;
+
+// Header of a table image written by ht_save. Positions are byte offsets
+// from the start of the file, so the image works wherever it's mapped.
+// Slots use the same control bytes and group probing as ht_array.
+typedef struct {
+  char magic[8];        // SNAP_MAGIC
+  uint64_t capacity;    // number of slots, power of two >= GROUP_WIDTH
+  uint64_t length;      // number of items
+  uint64_t nshards;     // shard count of the saved table
+  uint64_t seed;        // table's hash seed
+  uint64_t hash_check;  // hash function applied to SNAP_MAGIC with seed
+  uint64_t ctrl_off;    // capacity control bytes
+  uint64_t slots_off;   // capacity ht_snap_slots
+  uint64_t size;        // file size; key and value bytes fill the rest
+} ht_snap;
+
+typedef struct {
+  uint64_t hash;
+  uint64_t key_off;     // key bytes, NUL-terminated
+  uint64_t value_off;   // value bytes, at a multiple of SNAP_ALIGN
+  uint32_t key_len;
+  uint32_t value_len;
+} ht_snap_slot;
+
+#define SNAP_MAGIC "HTSNAP03"
+#define SNAP_ALIGN _Alignof(max_align_t)  // so values can be read in place
+
 // Hash table structure: create with ht_create, free with ht_destroy.
 struct ht {
-  ht_entry* entries;  // hash slots
-  size_t capacity;  // size of _entries array
-  size_t length;    // number of items in hash table
-  pthread_mutex_t mtx;
+  ht_shard* shards;   // array of nshards sub-tables
+  size_t nshards;     // power of two
+  unsigned shard_bits;  // log2(nshards)
+  hash_function hash;   // hashes keys, see hash.h
+  uint64_t seed;        // passed to hash, 0 unless keyed
+  ht_evict_function evict;  // cache tables: told of evicted items
+  void* evict_ctx;
+  // Table opened with ht_open_mapped: lookups go to the mapped image
+  // until the first modification copies its keys into the shards.
+  _Atomic(ht_snap*) snap;  // image still in use, else NULL
+  void* snap_map;     // mapping, kept until ht_destroy for the values
+  size_t snap_size;
+  pthread_mutex_t snap_mtx;  // serialises copying the image
 };
 
-#define INITIAL_CAPACITY 16  // must not be zero
+#define INITIAL_CAPACITY 16  // must be a power of two >= GROUP_WIDTH
+#define MAX_SHARD_BITS 16    // at most 65536 shards
+
+// Slots are never reused once written, so a reader that matched a key
+// can't see another key's value; CTRL_DELETED slots are dropped when the
+// shard is next rehashed.
+
+// Epoch-based reclamation. ht_get never locks: each reading thread
+// publishes the global epoch it entered in a reader record of its own,
+// and writers free memory readers may still see (old entries arrays,
+// removed keys) only once every record has left the epoch it was retired
+// in. Records are shared by all tables and reused after thread exit.
+typedef struct ht_reader {
+  _Alignas(64) _Atomic uint64_t epoch;  // 0 when not reading
+  atomic_bool in_use;  // owned by a live thread
+  struct ht_reader* next;
+} ht_reader;
+
+static _Atomic uint64_t ht_epoch = 1;
+static _Atomic(ht_reader*) ht_readers;  // never freed
+static _Thread_local ht_reader* ht_self;
+static pthread_key_t ht_reader_key;
+static pthread_once_t ht_reader_once = PTHREAD_ONCE_INIT;
+
+static void ht_reader_release(void* reader) {
+  atomic_store(&((ht_reader*)reader)->in_use, false);
+}
+
+static void ht_reader_init(void) {
+  pthread_key_create(&ht_reader_key, ht_reader_release);
+}
+
+// Return calling thread's reader record, or NULL if out of memory.
+static ht_reader* ht_reader_self(void) {
+  if (ht_self != NULL) {
+    return ht_self;
+  }
+  pthread_once(&ht_reader_once, ht_reader_init);
+
+  // Adopt a record left behind by an exited thread, else add a new one.
+  ht_reader* r;
+  for (r = atomic_load(&ht_readers); r != NULL; r = r->next) {
+    bool expected = false;
+    if (atomic_compare_exchange_strong(&r->in_use, &expected, true)) {
+      break;
+    }
+  }
+  if (r == NULL) {
+    r = aligned_alloc(_Alignof(ht_reader), sizeof(ht_reader));
+    if (r == NULL) {
+      return NULL;
+    }
+    atomic_init(&r->epoch, 0);
+    atomic_init(&r->in_use, true);
+    r->next = atomic_load(&ht_readers);
+    while (!atomic_compare_exchange_weak(&ht_readers, &r->next, r)) {
+    }
+  }
+  pthread_setspecific(ht_reader_key, r);
+  ht_self = r;
+  return r;
+}
+
+// Enter read-side critical section. Return NULL if the thread can't get
+// a reader record, in which case the caller must lock instead.
+static ht_reader* ht_read_lock(void) {
+  ht_reader* r = ht_reader_self();
+  if (r != NULL) {
+    atomic_store_explicit(&r->epoch, atomic_load(&ht_epoch),
+      memory_order_relaxed);
+    // Order the epoch store before any load of table memory.
+    atomic_thread_fence(memory_order_seq_cst);
+  }
+  return r;
+}
+
+static void ht_read_unlock(ht_reader* r) {
+  atomic_store_explicit(&r->epoch, 0, memory_order_release);
+}
+
+// Wait until no reader can still hold memory unpublished before this call.
+static void ht_synchronize(void) {
+  uint64_t target = atomic_fetch_add(&ht_epoch, 1) + 1;
+  for (ht_reader* r = atomic_load(&ht_readers); r != NULL; r = r->next) {
+    uint64_t e;
+    while ((e = atomic_load_explicit(&r->epoch, memory_order_acquire)) != 0
+        && e < target) {
+      sched_yield();
+    }
+  }
+}
+
+// Free everything retired from shard, once readers are done with it.
+static void ht_reclaim(ht_shard* shard) {
+  if (shard->nretired == 0) {
+    return;
+  }
+  ht_synchronize();
+  for (size_t i = 0; i < shard->nretired; i++) {
+    free(shard->retired[i]);
+  }
+  shard->nretired = 0;
+}
+
+// Queue p to be freed once no reader can see it. Caller holds shard lock.
+static void ht_retire(ht_shard* shard, void* p) {
+  if (shard->nretired == RETIRE_BATCH) {
+    ht_reclaim(shard);
+  }
+  shard->retired[shard->nretired++] = p;
+}
+
+// Allocate (zero'd, so all CTRL_EMPTY) array of capacity slots, with
+// cache fields if cache is true, or return NULL if out of memory. The
+// entries are only touched as they're appended, so the pages of a large
+// array's unused tail aren't even mapped in.
+static ht_array* ht_array_new(size_t capacity, bool cache) {
+  size_t nentries = HT_ENTRIES(capacity);
+  unsigned index_size = nentries <= 0x100 ? 1 : nentries <= 0x10000 ? 2 : 4;
+  size_t size = sizeof(ht_array) + nentries * sizeof(ht_entry)
+    + capacity * (1 + index_size) + nentries;
+  if (cache) {
+    size += nentries * (sizeof(uint64_t) + 1);
+  }
+  ht_array* array = calloc(1, size);
+  if (array == NULL) {
+    return NULL;
+  }
+  array->capacity = capacity;
+  array->index_size = index_size;
+  char* p = (char*)&array->entries[nentries];
+  if (cache) {
+    array->expires = (uint64_t*)p;
+    p += nentries * sizeof(uint64_t);
+  }
+  // Slot arrays next: capacity is a multiple of 16, keeping them aligned.
+  array->ctrl = (uint8_t*)p;
+  array->index = p + capacity;
+  p += capacity * (1 + index_size);
+  array->live = (uint8_t*)p;
+  if (cache) {
+    array->ref = array->live + nentries;
+  }
+  return array;
+}
+
+// Return position of the entry of slot i.
+static inline size_t ht_index_get(const ht_array* array, size_t i) {
+  switch (array->index_size) {
+  case 1:
+    return ((const uint8_t*)array->index)[i];
+  case 2:
+    return ((const uint16_t*)array->index)[i];
+  default:
+    return ((const uint32_t*)array->index)[i];
+  }
+}
+
+static inline void ht_index_set(ht_array* array, size_t i, size_t pos) {
+  switch (array->index_size) {
+  case 1:
+    ((uint8_t*)array->index)[i] = (uint8_t)pos;
+    break;
+  case 2:
+    ((uint16_t*)array->index)[i] = (uint16_t)pos;
+    break;
+  default:
+    ((uint32_t*)array->index)[i] = (uint32_t)pos;
+    break;
+  }
+}
+
+// Return nanoseconds of a monotonic clock.
+static uint64_t ht_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+// Return milliseconds of the same clock, the time base of expiries.
+static uint64_t ht_now_ms(void) {
+  return ht_now_ns() / 1000000;
+}
+
+// Lock shard, counting whether it had to wait: an uncontended trylock
+// costs no more than a plain lock.
+static void ht_lock(ht_shard* shard) {
+  if (pthread_mutex_trylock(&shard->mtx) != 0) {
+    pthread_mutex_lock(&shard->mtx);
+    shard->lock_waits++;
+  }
+  shard->locks++;
+}
+
+// ThreadSanitizer doesn't model fences, so under it ht_match loads each
+// control byte with acquire, instead of relaxed followed by a fence.
+#if defined(__SANITIZE_THREAD__)
+#define HT_TSAN 1
+#elif defined(__has_feature)
+#if __has_feature(thread_sanitizer)
+#define HT_TSAN 1
+#endif
+#endif
+#if defined(HT_TSAN)
+#define HT_CTRL_LOAD __ATOMIC_ACQUIRE
+#else
+#define HT_CTRL_LOAD __ATOMIC_RELAXED
+#endif
+
+// Publish control byte of slot i, after the slot's entry is written.
+static void ht_set_ctrl(ht_array* array, size_t i, uint8_t ctrl) {
+  __atomic_store_n(&array->ctrl[i], ctrl, __ATOMIC_RELEASE);
+}
+
+// Return bitmask of the slots in group starting at ctrl whose control
+// byte equals c.
+static inline uint32_t ht_match(const uint8_t* ctrl, uint8_t c) {
+  uint32_t mask;
+#if defined(__SSE2__) && !defined(HT_TSAN)
+  // Deliberately racy: lock-free readers load the group while a writer
+  // may be storing one of its bytes with ht_set_ctrl. C11 has no atomic
+  // 16-byte load, but on x86 each byte of an SSE load reads either its
+  // old or its new value, which is all probing needs (as in other
+  // SwissTables). ThreadSanitizer builds take the atomic path below.
+  __m128i group = _mm_loadu_si128((const __m128i*)ctrl);
+  mask = (uint32_t)_mm_movemask_epi8(
+    _mm_cmpeq_epi8(group, _mm_set1_epi8((char)c)));
+#else
+  mask = 0;
+  for (int i = 0; i < GROUP_WIDTH; i++) {
+    mask |= (uint32_t)(__atomic_load_n(&ctrl[i], HT_CTRL_LOAD) == c) << i;
+  }
+#endif
+#if !defined(HT_TSAN)
+  // Pairs with ht_set_ctrl: entries of matched slots are visible.
+  atomic_thread_fence(memory_order_acquire);
+#endif
+  return mask;
+}
+
+// Group probe sequence: start at the group picked by hash bits above the
+// 7 kept in control bytes, then step 1, 2, 3... groups (triangular
+// probing, visits every group once as the count is a power of two).
+#define HT_PROBE_START(array, hash) \
+  ((size_t)((hash) >> 7) & ((array)->capacity / GROUP_WIDTH - 1))
+#define HT_PROBE_NEXT(array, group, step) \
+  (((group) + (step)) & ((array)->capacity / GROUP_WIDTH - 1))
+#define HT_TAG(hash) ((uint8_t)(CTRL_FULL | ((hash) & 0x7f)))
 
 ht* ht_create(void) {
+  return ht_create_sharded(1);
+}
+
+ht* ht_create_sharded(size_t nshards) {
+  return ht_create_with_hash(nshards, NULL);
+}
+
+// Create table with shards of given capacity; a cache table holds about
+// max_entries items, split evenly between shards, else max_entries is 0.
+static ht* ht_new(size_t nshards, hash_function hash, size_t max_entries,
+    size_t capacity) {
+  // Round shard count up to a power of two.
+  unsigned bits = 0;
+  while (((size_t)1 << bits) < nshards && bits < MAX_SHARD_BITS) {
+    bits++;
+  }
+
   // Allocate space for hash table struct.
   ht* table = malloc(sizeof(ht));
   if (table == NULL) {
     return NULL;
   }
-  table->length = 0;
-  table->capacity = INITIAL_CAPACITY;
+  table->shard_bits = bits;
+  table->nshards = (size_t)1 << bits;
+  size_t max_length = max_entries / table->nshards
+    + (max_entries % table->nshards != 0);
+  table->hash = (hash == NULL) ? &hash_wyhash : hash;
+  table->seed = 0;
+  table->evict = NULL;
+  table->evict_ctx = NULL;
+  atomic_init(&table->snap, NULL);
+  table->snap_map = NULL;
+  table->snap_size = 0;
+  if (pthread_mutex_init(&table->snap_mtx, NULL) != 0) {
+    free(table);
+    return NULL;
+  }
+  table->shards = aligned_alloc(_Alignof(ht_shard),
+    table->nshards * sizeof(ht_shard));
+  if (table->shards == NULL) {
+    pthread_mutex_destroy(&table->snap_mtx);
+    free(table);
+    return NULL;
+  }
 
-  // Allocate (zero'd) space for entry buckets.
-  table->entries = calloc(table->capacity, sizeof(ht_entry));
-  if (table->entries == NULL) {
-    free(table); // error, free table before we return!
+  for (size_t s = 0; s < table->nshards; s++) {
+    ht_shard* shard = &table->shards[s];
+    shard->rehash_index = 0;
+    shard->rehash_pos = 0;
+    shard->length = 0;
+    shard->max_length = max_length;
+    shard->clock_hand = 0;
+    shard->nretired = 0;
+    shard->expansions = 0;
+    shard->rehash_ns = 0;
+    shard->locks = 0;
+    shard->lock_waits = 0;
+    shard->reseeds = 0;
+
+    // Allocate (zero'd) space for entry buckets.
+    ht_array* array = ht_array_new(capacity, max_length != 0);
+    atomic_init(&shard->array, array);
+    if (array != NULL) {
+      if (pthread_mutex_init(&shard->mtx, NULL) == 0) {
+        continue;
+      }
+      free(array);
+    }
+    // error, unwind the shards initialised so far before we return!
+    while (s-- > 0) {
+      pthread_mutex_destroy(&table->shards[s].mtx);
+      free(atomic_load(&table->shards[s].array));
+    }
+    pthread_mutex_destroy(&table->snap_mtx);
+    free(table->shards);
+    free(table);
     return NULL;
   }
+  return table;
+}
 
-  if(pthread_mutex_init(&table->mtx, NULL) == 0) {
-    return table;
+ht* ht_create_with_hash(size_t nshards, hash_function hash) {
+  return ht_new(nshards, hash, 0, INITIAL_CAPACITY);
+}
+
+// Return a random seed, never 0: from the kernel's entropy source if
+// there is one, else mixed from the clock and addresses.
+static uint64_t ht_random_seed(void) {
+  uint64_t seed;
+  if (getentropy(&seed, sizeof(seed)) != 0) {
+    static _Atomic uint64_t calls;
+    uint64_t mix[3] = {
+      ht_now_ns(), (uint64_t)(uintptr_t)&seed, atomic_fetch_add(&calls, 1)
+    };
+    seed = hash_wyhash(mix, sizeof(mix), (uint64_t)(uintptr_t)&calls);
   }
-  free(table->entries);
-  free(table);
-  return NULL;
+  return seed != 0 ? seed : 1;
+}
+
+ht* ht_create_keyed(size_t nshards) {
+  ht* table = ht_new(nshards, &hash_siphash13, 0, INITIAL_CAPACITY);
+  if (table != NULL) {
+    table->seed = ht_random_seed();
+  }
+  return table;
+}
+
+static size_t ht_capacity_fit(size_t length);
+
+ht* ht_create_with_capacity(size_t nshards, size_t n) {
+  // Keys don't spread quite evenly, so leave each shard 1/8 extra room.
+  size_t shards = 1;
+  while (shards < nshards && shards < ((size_t)1 << MAX_SHARD_BITS)) {
+    shards *= 2;
+  }
+  size_t length = n / shards + 1;
+  size_t capacity = ht_capacity_fit(length + length / 8);
+  if (capacity == 0) {
+    return NULL;
+  }
+  return ht_new(nshards, NULL, 0, capacity);
+}
+
+ht* ht_create_cache(size_t nshards, size_t max_entries,
+    ht_evict_function evict, void* ctx) {
+  if (max_entries == 0) {
+    return NULL;
+  }
+  ht* table = ht_new(nshards, NULL, max_entries, INITIAL_CAPACITY);
+  if (table != NULL) {
+    table->evict = evict;
+    table->evict_ctx = ctx;
+  }
+  return table;
 }
 
 void ht_destroy(ht* table) {
-  // First free allocated keys.
-  for (size_t i = 0; i < table->capacity; i++) {
-    free((void*)table->entries[i].key);
+  for (size_t s = 0; s < table->nshards; s++) {
+    ht_shard* shard = &table->shards[s];
+    ht_array* array = atomic_load(&shard->array);
+    while (array != NULL) {
+      // First free spilled keys (removed ones are retired or moved).
+      for (size_t i = 0; i < array->used; i++) {
+        ht_entry* entry = &array->entries[i];
+        if (array->live[i] && entry->key_len >= INLINE_KEY) {
+          free((void*)ht_entry_key(entry));
+        }
+      }
+      ht_array* next = array->next;
+      free(array);
+      array = next;
+    }
+    for (size_t i = 0; i < shard->nretired; i++) {
+      free(shard->retired[i]);
+    }
+    pthread_mutex_destroy(&shard->mtx);
+  }
+  // Then unmap any snapshot, free shards array and table itself.
+  if (table->snap_map != NULL) {
+    munmap(table->snap_map, table->snap_size);
   }
-  pthread_mutex_destroy(&table->mtx);
-  // Then free entries array and table itself.
-  free(table->entries);
+  pthread_mutex_destroy(&table->snap_mtx);
+  free(table->shards);
   free(table);
 }
 
-#define FNV_OFFSET 14695981039346656037UL
-#define FNV_PRIME 1099511628211UL
+// Return 64-bit hash for key of len bytes, using table's hash function.
+static inline uint64_t hash_key(ht* table, const char* key, size_t len) {
+  return table->hash(key, len, table->seed);
+}
+
+// Return shard owning hash. Slots within a shard are picked with the low
+// bits, so use the top bits here to keep the two independent.
+static ht_shard* ht_shard_for(ht* table, uint64_t hash) {
+  size_t s = (size_t)((hash >> 32) >> (32 - table->shard_bits));
+  return &table->shards[s];
+}
+
+// Return hash placing key in array, given its hash under the table's
+// hash function: the same, unless the array was reseeded.
+static inline uint64_t ht_array_hash(const ht_array* array, const char* key,
+    size_t len, uint64_t hash) {
+  return array->seed == 0 ? hash : hash_siphash13(key, len, array->seed);
+}
+
+#define NOT_FOUND SIZE_MAX
+
+// Return position of the entry holding key in array, or NOT_FOUND. Safe
+// without the shard lock while array can't be reclaimed.
+static size_t ht_find(ht_array* array, const char* key, size_t len,
+    uint64_t hash) {
+  hash = ht_array_hash(array, key, len, hash);
+  uint8_t tag = HT_TAG(hash);
+  size_t group = HT_PROBE_START(array, hash);
+  size_t ngroups = array->capacity / GROUP_WIDTH;
 
-// Return 64-bit FNV-1a hash for key (NUL-terminated). See description:
-// https://en.wikipedia.org/wiki/Fowler–Noll–Vo_hash_function
-static uint64_t hash_key(const char* key) {
-  uint64_t hash = FNV_OFFSET;
-  for (const char* p = key; *p; p++) {
-    hash ^= (uint64_t)(unsigned char)(*p);
-    hash *= FNV_PRIME;
+  for (size_t step = 1; step <= ngroups; step++) {
+    const uint8_t* ctrl = &array->ctrl[group * GROUP_WIDTH];
+    // Only compare keys of slots whose tag matches.
+    for (uint32_t m = ht_match(ctrl, tag); m != 0; m &= m - 1) {
+      size_t i = ht_index_get(array,
+        group * GROUP_WIDTH + (size_t)__builtin_ctz(m));
+      ht_entry* entry = &array->entries[i];
+      // Hash and length compares reject tag collisions without
+      // touching spilled key bytes.
+      if (entry->hash == hash && entry->key_len == len
+          && memcmp(key, ht_entry_key(entry), len) == 0) {
+        // Found key.
+        return i;
+      }
+    }
+    // An empty slot in the group means the key was never pushed past it.
+    if (ht_match(ctrl, CTRL_EMPTY) != 0) {
+      break;
+    }
+    group = HT_PROBE_NEXT(array, group, step);
   }
-  return hash;
+  return NOT_FOUND;
 }
 
-void* ht_get(ht* table, const char* key) {
-  // AND hash with capacity-1 to ensure it's within entries array.
-  uint64_t hash = hash_key(key);
-  size_t index = (size_t)(hash & (uint64_t)(table->capacity - 1));
-  size_t i = index;
-
-  pthread_mutex_lock(&table->mtx);
-  // Loop till we find an empty entry.
-  while (table->entries[i].key != NULL) {
-    if (strcmp(key, table->entries[i].key) == 0) {
-      // Found key, return value.
-      void * val = table->entries[i].value;
-      pthread_mutex_unlock(&table->mtx);
-      return val;
-    }
-    // Key wasn't in this slot, move to next (linear probing).
-    i++;
-    if (i >= table->capacity) {
-      // At end of entries array, wrap around.
-      i = 0;
-    }
-    if (i == index) break;
-  }
-  pthread_mutex_unlock(&table->mtx);
+// Find key in array or the arrays it's migrating to; return the array
+// holding it and set *index to its entry, or return NULL if not found. A
+// key is moved to next before its old slot is marked, so a reader that
+// missed it in one array finds it in the next.
+static ht_array* ht_find_all(ht_array* array, const char* key, size_t len,
+    uint64_t hash, size_t* index) {
+  for (; array != NULL;
+      array = atomic_load_explicit(&array->next, memory_order_acquire)) {
+    *index = ht_find(array, key, len, hash);
+    if (*index != NOT_FOUND) {
+      return array;
+    }
+  }
   return NULL;
 }
 
-// Internal function to set an entry (without expanding table).
-static const char* ht_set_entry(ht_entry* entries, size_t capacity,
-    const char* key, void* value, size_t* plength) {
-  // AND hash with capacity-1 to ensure it's within entries array.
-  uint64_t hash = hash_key(key);
-  size_t index = (size_t)(hash & (uint64_t)(capacity - 1));
-  size_t i = index;
+// Return true if entry i of cache array has expired by time now.
+static inline bool ht_expired(ht_array* array, size_t i, uint64_t now) {
+  uint64_t expires = __atomic_load_n(&array->expires[i], __ATOMIC_RELAXED);
+  return expires != 0 && expires <= now;
+}
 
-  // Loop till we find an empty entry.
-  while (entries[i].key != NULL) {
-    if (strcmp(key, entries[i].key) == 0) {
-      // Found key (it already exists), update value.
-      entries[i].value = value;
-      return entries[i].key;
+// Return value of entry i for a reader. In a cache table, return NULL if
+// the item has expired, else mark it recently used for ht_evict (only
+// storing when the bit is clear, so hot items don't bounce cache lines).
+static inline void* ht_read_value(ht_array* array, size_t i) {
+  if (array->ref != NULL) {
+    if (__atomic_load_n(&array->expires[i], __ATOMIC_RELAXED) != 0
+        && ht_expired(array, i, ht_now_ms())) {
+      return NULL;
     }
-    // Key wasn't in this slot, move to next (linear probing).
-    i++;
-    if (i >= capacity) {
-      // At end of entries array, wrap around.
-      i = 0;
+    if (__atomic_load_n(&array->ref[i], __ATOMIC_RELAXED) == 0) {
+      __atomic_store_n(&array->ref[i], 1, __ATOMIC_RELAXED);
     }
-    if (i == index) return NULL;
   }
+  return atomic_load_explicit(&array->entries[i].value, memory_order_acquire);
+}
 
-  // Didn't find key, allocate+copy if needed, then insert it.
-  if (plength != NULL) {
-    key = strdup(key);
-    if (key == NULL) {
-      return NULL;
+void* ht_get(ht* table, const char* key) {
+  return ht_get_n(table, key, strlen(key));
+}
+
+static void* ht_snap_get(ht_snap* snap, const char* key, size_t len,
+    uint64_t hash);
+static int ht_put(ht* table, const char* key, size_t len, uint64_t hash,
+    void* value, uint64_t expires);
+static int ht_put_locked(ht* table, ht_shard* shard, const char* key,
+    size_t len, uint64_t hash, void* value, uint64_t expires);
+static ht_array* ht_upsert(ht* table, ht_shard* shard, const char* key,
+    size_t len, uint64_t hash, size_t* index, bool* inserted);
+
+void* ht_get_n(ht* table, const char* key, size_t len) {
+  uint64_t hash = hash_key(table, key, len);
+  ht_shard* shard = ht_shard_for(table, hash);
+  ht_array* array;
+  size_t i;
+  void* value = NULL;
+
+  // The mapping outlives the table's use of it, so no epoch is needed.
+  ht_snap* snap = atomic_load_explicit(&table->snap, memory_order_acquire);
+  if (snap != NULL) {
+    return ht_snap_get(snap, key, len, hash);
+  }
+
+  ht_reader* reader = ht_read_lock();
+  if (reader != NULL) {
+    array = ht_find_all(atomic_load_explicit(&shard->array,
+      memory_order_acquire), key, len, hash, &i);
+    if (array != NULL) {
+      value = ht_read_value(array, i);
     }
-    (*plength)++;
+    ht_read_unlock(reader);
+  } else {
+    ht_lock(shard);
+    array = ht_find_all(atomic_load(&shard->array), key, len, hash, &i);
+    if (array != NULL) {
+      value = ht_read_value(array, i);
+    }
+    pthread_mutex_unlock(&shard->mtx);
   }
-  entries[index].key = (char*)key;
-  entries[index].value = value;
-  return key;
+  return value;
 }
 
-// Expand hash table to twice its current size. Return true on success,
-// false if out of memory.
-static bool ht_expand(ht* table) {
-  // Allocate new entries array.
-  size_t new_capacity = table->capacity * 2;
-  if (new_capacity < table->capacity) {
-    return false;  // overflow (capacity would be too big)
+#define GET_BATCH 16  // keys in flight per ht_get_many pipeline round
+
+size_t ht_get_many(ht* table, const char* const* keys, size_t n,
+    void** values) {
+  return ht_get_many_n(table, keys, NULL, n, values);
+}
+
+size_t ht_get_many_n(ht* table, const char* const* keys, const size_t* lens,
+    size_t n, void** values) {
+  // A mapped image needs no epoch; without a reader record there's none.
+  ht_reader* reader = NULL;
+  if (atomic_load(&table->snap) == NULL) {
+    reader = ht_read_lock();
   }
-  ht_entry* new_entries = calloc(new_capacity, sizeof(ht_entry));
-  if (new_entries == NULL) {
-    return false;
+  size_t found = 0;
+
+  if (reader == NULL) {
+    // Mapped image or no reader record: one lookup per key.
+    for (size_t k = 0; k < n; k++) {
+      size_t len = lens != NULL ? lens[k] : strlen(keys[k]);
+      values[k] = ht_get_n(table, keys[k], len);
+      found += values[k] != NULL;
+    }
+    return found;
+  }
+
+  for (size_t base = 0; base < n; base += GET_BATCH) {
+    if (base != 0) {
+      // Leave the epoch between rounds: ht_synchronize, run by writers
+      // under a shard lock, then waits for one round at most, not n keys.
+      // (The record is the thread's own, so it's there again.)
+      ht_read_unlock(reader);
+      ht_read_lock();
+    }
+    size_t count = n - base < GET_BATCH ? n - base : GET_BATCH;
+    uint64_t hashes[GET_BATCH];
+    size_t key_lens[GET_BATCH];
+    ht_array* arrays[GET_BATCH];
+
+    // Hash every key and prefetch its home group's control bytes and
+    // entry positions...
+    for (size_t k = 0; k < count; k++) {
+      const char* key = keys[base + k];
+      key_lens[k] = lens != NULL ? lens[base + k] : strlen(key);
+      hashes[k] = hash_key(table, key, key_lens[k]);
+      arrays[k] = atomic_load_explicit(
+        &ht_shard_for(table, hashes[k])->array, memory_order_acquire);
+      // From here on, the hash placing the key in its array.
+      hashes[k] = ht_array_hash(arrays[k], key, key_lens[k], hashes[k]);
+      size_t group = HT_PROBE_START(arrays[k], hashes[k]);
+      __builtin_prefetch(&arrays[k]->ctrl[group * GROUP_WIDTH]);
+      __builtin_prefetch((char*)arrays[k]->index
+        + group * GROUP_WIDTH * arrays[k]->index_size);
+    }
+    // ...then the first entry whose tag matches...
+    for (size_t k = 0; k < count; k++) {
+      size_t group = HT_PROBE_START(arrays[k], hashes[k]);
+      uint32_t m = ht_match(&arrays[k]->ctrl[group * GROUP_WIDTH],
+        HT_TAG(hashes[k]));
+      if (m != 0) {
+        __builtin_prefetch(&arrays[k]->entries[ht_index_get(arrays[k],
+          group * GROUP_WIDTH + (size_t)__builtin_ctz(m))]);
+      }
+    }
+    // ...and probe once all those misses are in flight together.
+    for (size_t k = 0; k < count; k++) {
+      size_t i;
+      ht_array* array = ht_find_all(arrays[k], keys[base + k], key_lens[k],
+        hashes[k], &i);
+      values[base + k] = array != NULL ? ht_read_value(array, i) : NULL;
+      found += values[base + k] != NULL;
+    }
+  }
+  ht_read_unlock(reader);
+  return found;
+}
+
+// Internal function to store an entry whose key is not in array yet at
+// free position i, with given expiry if array is a cache's, and point the
+// first empty slot of its probe sequence at it. Array must not be full.
+// Return the number of groups probed, not counting those holding removed
+// keys: churn lengthens probes too, but the next rehash clears it anyway.
+static size_t ht_insert(ht_array* array, size_t i, const ht_entry* entry,
+    uint64_t expires) {
+  size_t group = HT_PROBE_START(array, entry->hash);
+  size_t probes = 1;
+  uint32_t m;
+
+  // Loop till we find a group with an empty slot.
+  for (size_t step = 1;
+      (m = ht_match(&array->ctrl[group * GROUP_WIDTH], CTRL_EMPTY)) == 0;
+      step++) {
+    probes += ht_match(&array->ctrl[group * GROUP_WIDTH], CTRL_DELETED) == 0;
+    group = HT_PROBE_NEXT(array, group, step);
+  }
+  size_t slot = group * GROUP_WIDTH + (size_t)__builtin_ctz(m);
+  memcpy(&array->entries[i], entry, sizeof(ht_entry));
+  array->live[i] = 1;
+  if (array->ref != NULL) {
+    // New items start unreferenced: they're appended furthest from the
+    // hand (which sweeps in insertion order), so have a full lap to be read.
+    array->expires[i] = expires;
+    array->ref[i] = 0;
   }
+  ht_index_set(array, slot, i);
+  ht_set_ctrl(array, slot, HT_TAG(entry->hash));
+  return probes;
+}
 
-  // Iterate entries, move all non-empty ones to new table's entries.
-  for (size_t i = 0; i < table->capacity; i++) {
-    ht_entry entry = table->entries[i];
-    if (entry.key != NULL) {
-      ht_set_entry(new_entries, new_capacity, entry.key, entry.value, NULL);
+// Return slot pointing at live entry i of array. Caller holds shard lock.
+static size_t ht_slot_of(ht_array* array, size_t i) {
+  uint64_t hash = array->entries[i].hash;
+  size_t group = HT_PROBE_START(array, hash);
+  for (size_t step = 1;; step++) {
+    for (uint32_t m = ht_match(&array->ctrl[group * GROUP_WIDTH],
+        HT_TAG(hash)); m != 0; m &= m - 1) {
+      size_t slot = group * GROUP_WIDTH + (size_t)__builtin_ctz(m);
+      if (ht_index_get(array, slot) == i) {
+        return slot;
+      }
     }
+    group = HT_PROBE_NEXT(array, group, step);
   }
+}
 
-  // Free old entries array and update this table's details.
-  free(table->entries);
-  table->entries = new_entries;
-  table->capacity = new_capacity;
+// Return the array new keys of shard go to. Caller holds shard lock.
+static ht_array* ht_newest(ht_shard* shard) {
+  ht_array* array = atomic_load(&shard->array);
+  return array->next != NULL ? array->next : array;
+}
+
+// Migrate up to nentries entries of the shard's oldest array into the next
+// one; once it's drained, retire it. Caller holds shard lock.
+static void ht_rehash_step(ht_shard* shard, size_t nentries) {
+  ht_array* array = atomic_load(&shard->array);
+  ht_array* next = array->next;
+  if (next == NULL) {
+    return;
+  }
+  uint64_t start = ht_now_ns();
+
+  // Entries move in order into positions reserved for them ahead of
+  // any added since, so next keeps insertion order.
+  size_t end = array->used - shard->rehash_index;
+  end = shard->rehash_index + (nentries < end ? nentries : end);
+  for (size_t i = shard->rehash_index; i < end; i++) {
+    if (array->live[i]) {
+      const ht_entry* entry = &array->entries[i];
+      ht_entry moved;
+      if (next->seed != array->seed) {
+        // Reseeding: the key goes where its new hash places it.
+        memcpy(&moved, entry, sizeof(moved));
+        moved.hash = hash_siphash13(ht_entry_key(entry), entry->key_len,
+          next->seed);
+        entry = &moved;
+      }
+      // Publish the key in next before hiding it here, see ht_find_all.
+      size_t j = shard->rehash_pos++;
+      if (array->ref != NULL) {
+        ht_insert(next, j, entry, array->expires[i]);
+        next->ref[j] = array->ref[i];
+      } else {
+        ht_insert(next, j, entry, 0);
+      }
+      ht_set_ctrl(array, ht_slot_of(array, i), CTRL_DELETED);
+      array->live[i] = 0;
+    }
+  }
+  shard->rehash_index = end;
+
+  if (end == array->used) {
+    // Drained: readers start from next from now on, free the old array
+    // once the ones still probing it are done.
+    atomic_store_explicit(&shard->array, next, memory_order_release);
+    shard->rehash_index = 0;
+    ht_retire(shard, array);
+    ht_reclaim(shard);
+  }
+  shard->rehash_ns += ht_now_ns() - start;
+}
+
+// Return true if an array of twice capacity slots is possible: its size
+// must fit in a size_t and entry positions in 4-byte index elements.
+static bool ht_can_double(size_t capacity) {
+  return (uint64_t)capacity < ((uint64_t)1 << 32)
+    && capacity <= SIZE_MAX / 2 / (sizeof(ht_entry) + 8);
+}
+
+// Return capacity to rehash a shard holding length keys into: the
+// smallest that leaves it under 7/16 full, i.e. with as much room to grow
+// before the next rehash at 7/8. Return 0 on overflow.
+static size_t ht_capacity_for(size_t length) {
+  size_t capacity = INITIAL_CAPACITY;
+  while (capacity / 16 * 7 < length) {
+    if (!ht_can_double(capacity)) {
+      return 0;
+    }
+    capacity *= 2;
+  }
+  return capacity;
+}
+
+// Return smallest capacity holding length keys without reaching the
+// 7/8 load that triggers a rehash, or 0 on overflow.
+static size_t ht_capacity_fit(size_t length) {
+  size_t capacity = INITIAL_CAPACITY;
+  while (capacity / 8 * 7 <= length) {
+    if (!ht_can_double(capacity)) {
+      return 0;
+    }
+    capacity *= 2;
+  }
+  return capacity;
+}
+
+// Start rehashing shard into an array of new_capacity slots (0 meaning
+// the size overflowed), placing keys under a new random seed if reseed
+// is true. Entries are then moved over by ht_rehash_step. Return true on
+// success, false if out of memory.
+static bool ht_resize(ht_shard* shard, size_t new_capacity, bool reseed) {
+  // A rehash still running must finish first.
+  ht_rehash_step(shard, SIZE_MAX);
+
+  // Allocate new entries array.
+  ht_array* array = atomic_load(&shard->array);
+  if (new_capacity == 0) {
+    return false;  // overflow (capacity would be too big)
+  }
+  uint64_t start = ht_now_ns();
+  ht_array* new_array = ht_array_new(new_capacity, shard->max_length != 0);
+  shard->rehash_ns += ht_now_ns() - start;
+  if (new_array == NULL) {
+    return false;
+  }
+  // Reserve the first positions for the entries to migrate (fewer may
+  // arrive, if some are removed first).
+  new_array->used = shard->length;
+  new_array->seed = reseed ? ht_random_seed() : array->seed;
+  atomic_store_explicit(&array->next, new_array, memory_order_release);
+  shard->rehash_index = 0;
+  shard->rehash_pos = 0;
+  shard->expansions++;
+  shard->reseeds += reseed;
   return true;
 }
 
+// Start rehashing shard into an array sized for its live keys: twice the
+// current size when it filled up with keys, the same size when it filled
+// up with removed ones, smaller after mass removals. Return true on
+// success, false if out of memory.
+static bool ht_expand(ht_shard* shard, size_t length) {
+  return ht_resize(shard, ht_capacity_for(length), false);
+}
+
+// Start rehashing shard, at the size ht_expand would pick, into an array
+// that places keys by hash_siphash13 under a secret random seed. Called
+// when an insert probed far more groups than a random hash would ever
+// need: the keys were picked to collide under the table's hash (or it's
+// a poor one), and lookups of them would each scan the pile-up. Return
+// true on success, false if out of memory.
+static bool ht_reseed(ht_shard* shard) {
+  return ht_resize(shard, ht_capacity_for(shard->length), true);
+}
+
 int ht_set(ht* table, const char* key, void* value) {
+  return ht_set_n(table, key, strlen(key), value);
+}
+
+static bool ht_unshare(ht* table);
+
+int ht_set_n(ht* table, const char* key, size_t len, void* value) {
+  assert(value != NULL);
+  if (value == NULL || len > UINT32_MAX || !ht_unshare(table)) {
+    return -1;
+  }
+  return ht_put(table, key, len, hash_key(table, key, len), value, 0);
+}
+
+int ht_set_ttl(ht* table, const char* key, void* value, uint64_t ttl_ms) {
+  return ht_set_ttl_n(table, key, strlen(key), value, ttl_ms);
+}
+
+int ht_set_ttl_n(ht* table, const char* key, size_t len, void* value,
+    uint64_t ttl_ms) {
   assert(value != NULL);
-  if (value == NULL) {
+  if (value == NULL || len > UINT32_MAX || table->shards[0].max_length == 0) {
+    return -1;  // expiry needs a cache table
+  }
+  uint64_t expires = 0;
+  if (ttl_ms != 0) {
+    uint64_t now = ht_now_ms();
+    expires = ttl_ms < UINT64_MAX - now ? now + ttl_ms : UINT64_MAX;
+  }
+  return ht_put(table, key, len, hash_key(table, key, len), value, expires);
+}
+
+// Drop item in entry i of one of shard's arrays, freeing its key once
+// readers are done with it. Caller holds shard lock.
+static void ht_unlink(ht_shard* shard, ht_array* array, size_t i) {
+  // Readers may be comparing against the key right now, so only mark the
+  // slot and free a spilled key once they're done.
+  ht_entry* entry = &array->entries[i];
+  ht_set_ctrl(array, ht_slot_of(array, i), CTRL_DELETED);
+  array->live[i] = 0;
+  if (entry->key_len >= INLINE_KEY) {
+    ht_retire(shard, (void*)ht_entry_key(entry));
+  }
+  shard->length--;
+}
+
+// Evict item in entry i of a cache shard's array, passing it to the
+// table's evict function. Caller holds shard lock.
+static void ht_drop(ht* table, ht_shard* shard, ht_array* array, size_t i) {
+  if (table->evict != NULL) {
+    ht_entry* entry = &array->entries[i];
+    table->evict(ht_entry_key(entry), entry->key_len, entry->value,
+      table->evict_ctx);
+  }
+  ht_unlink(shard, array, i);
+}
+
+// Remove item in entry i of one of shard's arrays, then shrink the shard
+// once under 1/8 full, so memory follows the live key count (failing to
+// allocate the smaller array is harmless). Caller holds shard lock.
+static void ht_delete(ht_shard* shard, ht_array* array, size_t i) {
+  ht_unlink(shard, array, i);
+  array = atomic_load(&shard->array);
+  if (array->next == NULL && array->capacity > INITIAL_CAPACITY
+      && shard->length < array->capacity / 8) {
+    ht_expand(shard, shard->length);
+  }
+}
+
+// Find key in shard's arrays like ht_find_all, but in a cache, evict the
+// item if it has expired and report it missing. Caller holds shard lock.
+static ht_array* ht_find_live(ht* table, ht_shard* shard, const char* key,
+    size_t len, uint64_t hash, size_t* index) {
+  ht_array* array = ht_find_all(atomic_load(&shard->array), key, len, hash,
+    index);
+  if (array != NULL && array->ref != NULL
+      && ht_expired(array, *index, ht_now_ms())) {
+    ht_drop(table, shard, array, *index);
+    return NULL;
+  }
+  return array;
+}
+
+// Evict one item from a full cache shard with the CLOCK algorithm: sweep
+// the hand over its entries (the old array then the new while rehashing),
+// clearing read bits, until it meets an item that has expired or hasn't
+// been read since the hand last passed. Caller holds shard lock.
+static void ht_evict(ht* table, ht_shard* shard) {
+  ht_array* first = atomic_load(&shard->array);
+  size_t nentries = 0;
+  for (ht_array* array = first; array != NULL; array = array->next) {
+    nentries += array->used;
+  }
+  uint64_t now = ht_now_ms();
+
+  // The first sweep clears every bit, so the second finds a victim.
+  for (size_t n = 0; n < 2 * nentries; n++) {
+    size_t i = shard->clock_hand % nentries;
+    shard->clock_hand = i + 1;
+    ht_array* array = first;
+    while (i >= array->used) {
+      i -= array->used;
+      array = array->next;
+    }
+    if (!array->live[i]) {
+      continue;
+    }
+    if (array->ref[i] && !ht_expired(array, i, now)) {
+      __atomic_store_n(&array->ref[i], 0, __ATOMIC_RELAXED);
+      continue;
+    }
+    ht_drop(table, shard, array, i);
+    return;
+  }
+}
+
+// Internal function to set key with given hash to value, expiring at
+// given time (0 for never) in a cache table.
+static int ht_put(ht* table, const char* key, size_t len, uint64_t hash,
+    void* value, uint64_t expires) {
+  ht_shard* shard = ht_shard_for(table, hash);
+  ht_lock(shard);
+  int ret = ht_put_locked(table, shard, key, len, hash, value, expires);
+  pthread_mutex_unlock(&shard->mtx);
+  return ret;
+}
+
+// Same as ht_put, with key's shard locked by caller.
+static int ht_put_locked(ht* table, ht_shard* shard, const char* key,
+    size_t len, uint64_t hash, void* value, uint64_t expires) {
+  size_t i;
+  bool inserted;
+  ht_array* array = ht_upsert(table, shard, key, len, hash, &i, &inserted);
+  if (array == NULL) {
+    return -1;
+  }
+  if (array->ref != NULL) {
+    __atomic_store_n(&array->expires[i], expires, __ATOMIC_RELAXED);
+  }
+  atomic_store_explicit(&array->entries[i].value, value,
+    memory_order_release);
+  return 0;
+}
+
+// Find key in shard, or insert it with a NULL value, which readers take
+// as not found. Return array holding it and set *index to its slot and
+// *inserted, or return NULL if out of memory. Caller holds shard lock.
+static ht_array* ht_upsert(ht* table, ht_shard* shard, const char* key,
+    size_t len, uint64_t hash, size_t* index, bool* inserted) {
+  ht_rehash_step(shard, REHASH_STEP);
+
+  // If key already exists (in either array while rehashing), return it.
+  ht_array* array = ht_find_live(table, shard, key, len, hash, index);
+  *inserted = array == NULL;
+  if (array != NULL) {
+    if (array->ref != NULL) {
+      __atomic_store_n(&array->ref[*index], 1, __ATOMIC_RELAXED);
+    }
+    return array;
+  }
+
+  // A full cache makes room first.
+  if (shard->max_length != 0 && shard->length >= shard->max_length) {
+    ht_evict(table, shard);
+  }
+
+  // If used slots will exceed 7/8 of current capacity, expand it.
+  array = ht_newest(shard);
+  if (array->used >= array->capacity / 8 * 7) {
+    if (!ht_expand(shard, shard->length + 1)) {
+      return NULL;
+    }
+    array = ht_newest(shard);
+  }
+
+  // Didn't find key, copy it, then insert it and update length.
+  ht_entry entry;
+  if (!ht_entry_init(&entry, key, len, ht_array_hash(array, key, len, hash))) {
+    return NULL;
+  }
+  atomic_init(&entry.value, NULL);
+  *index = array->used++;
+  size_t probes = ht_insert(array, *index, &entry, 0);
+  shard->length++;
+  // With a random hash, the longest probe of a nearly full array grows
+  // with the log of its size: at 2^20 groups, about 18 groups are probed
+  // now and then. Keys picked to collide probe past that by far.
+  if (probes > FLOOD_PROBES
+      + (size_t)__builtin_ctzll(array->capacity / GROUP_WIDTH)) {
+    // The key stays put till the next write (failing to reseed is
+    // harmless, if slow).
+    ht_reseed(shard);
+  }
+  return array;
+}
+
+int ht_bulk_insert(ht* table, const char* const* keys, void* const* values,
+    size_t n) {
+  if (n == 0) {
+    return 0;  // (and malloc(0) may return NULL)
+  }
+  if (!ht_unshare(table)) {
     return -1;
   }
+  // Hash every key up front, then sort keys by shard (counting sort), so
+  // each shard is locked, sized and filled once. One shard needs no sort.
+  uint64_t* hashes = malloc(n * sizeof(uint64_t));
+  size_t* order = NULL;
+  size_t* starts = calloc(table->nshards + 1, sizeof(size_t));
+  int ret = -1;
+  if (table->nshards > 1) {
+    order = malloc(n * sizeof(size_t));
+    if (order == NULL) {
+      goto done;
+    }
+  }
+  if (hashes == NULL || starts == NULL) {
+    goto done;
+  }
+  for (size_t k = 0; k < n; k++) {
+    assert(values[k] != NULL);
+    size_t len = strlen(keys[k]);
+    if (values[k] == NULL || len > UINT32_MAX) {
+      goto done;
+    }
+    hashes[k] = hash_key(table, keys[k], len);
+    starts[ht_shard_for(table, hashes[k]) - table->shards + 1]++;
+  }
+  for (size_t s = 0; s < table->nshards; s++) {
+    starts[s + 1] += starts[s];
+  }
+  if (order != NULL) {
+    for (size_t k = 0; k < n; k++) {
+      order[starts[ht_shard_for(table, hashes[k]) - table->shards]++] = k;
+    }
+    // Placing keys moved each start to the next shard's; shift them back.
+    memmove(starts + 1, starts, table->nshards * sizeof(size_t));
+    starts[0] = 0;
+  }
 
-  // If length will exceed half of current capacity, expand it.
-pthread_mutex_lock(&table->mtx);
-  if (table->length >= table->capacity / 2) {
-    if (!ht_expand(table)) {
-      pthread_mutex_unlock(&table->mtx);
-      return -1;
+  ret = 0;
+  for (size_t s = 0; s < table->nshards && ret == 0; s++) {
+    ht_shard* shard = &table->shards[s];
+    size_t count = starts[s + 1] - starts[s];
+    if (count == 0) {
+      continue;
+    }
+    ht_lock(shard);
+    // Grow once to fit all of them (cache tables evict instead), and
+    // migrate at once rather than a step per key. If that fails, inserts
+    // still grow the shard as needed.
+    ht_array* array = ht_newest(shard);
+    if (shard->max_length == 0
+        && array->used + count >= array->capacity / 8 * 7
+        && ht_resize(shard, ht_capacity_fit(shard->length + count), false)) {
+      ht_rehash_step(shard, SIZE_MAX);
+    }
+    for (size_t j = starts[s]; j < starts[s + 1]; j++) {
+      size_t k = order != NULL ? order[j] : j;
+      if (ht_put_locked(table, shard, keys[k], strlen(keys[k]), hashes[k],
+          values[k], 0) != 0) {
+        ret = -1;
+        break;
+      }
     }
+    pthread_mutex_unlock(&shard->mtx);
   }
 
-  // Set entry and update length.
-  const char * ret = ht_set_entry(
-    table->entries, table->capacity, key, value, &table->length
-  );
-  pthread_mutex_unlock(&table->mtx);
-  return ret ? 0 : -1;
+done:
+  free(starts);
+  free(order);
+  free(hashes);
+  return ret;
 }
 
 size_t ht_length(ht* table) {
-  return table->length;
+  ht_snap* snap = atomic_load(&table->snap);
+  if (snap != NULL) {
+    return snap->length;
+  }
+  size_t length = 0;
+  for (size_t s = 0; s < table->nshards; s++) {
+    length += table->shards[s].length;
+  }
+  return length;
 }
 
 hti ht_iterator(ht* table) {
   hti it;
   it._table = table;
+  it._shard = 0;
   it._index = 0;
   return it;
 }
 
 bool ht_next(hti* it) {
-  // Loop till we've hit end of entries array.
   ht* table = it->_table;
-  pthread_mutex_lock(&table->mtx);
-  while (it->_index < table->capacity) {
-    size_t i = it->_index;
-    it->_index++;
-    if (table->entries[i].key != NULL) {
-      // Found next non-empty item, update iterator key and value.
-      ht_entry entry = table->entries[i];
-      it->key = entry.key;
-      it->value = entry.value;
-      pthread_mutex_unlock(&table->mtx);
-      return true;
-    }
-  }
-  pthread_mutex_unlock(&table->mtx);
+  ht_snap* snap = atomic_load(&table->snap);
+  if (snap != NULL && it->_shard == 0) {
+    // Mapped table: walk the image's slots instead of the shards.
+    const char* base = (const char*)snap;
+    while (it->_index < snap->capacity) {
+      size_t i = it->_index;
+      it->_index++;
+      if ((uint8_t)base[snap->ctrl_off + i] & CTRL_FULL) {
+        const ht_snap_slot* slot =
+          (const ht_snap_slot*)(base + snap->slots_off) + i;
+        it->key = base + slot->key_off;
+        it->key_len = slot->key_len;
+        it->value = (void*)(base + slot->value_off);
+        return true;
+      }
+    }
+    it->_shard = table->nshards;
+    return false;
+  }
+
+  // Loop till we've hit end of the last shard's entries array, skipping
+  // expired cache items and ones ht_get_or_insert added without a value
+  // yet (ht_get doesn't find those either).
+  uint64_t now = table->shards[0].max_length != 0 ? ht_now_ms() : 0;
+  while (it->_shard < table->nshards) {
+    ht_shard* shard = &table->shards[it->_shard];
+    ht_lock(shard);
+    // Entries come in insertion order once a rehash is done, so finish
+    // any before starting the shard (as the table isn't modified while
+    // iterating, none starts after).
+    if (it->_index == 0) {
+      ht_rehash_step(shard, SIZE_MAX);
+    }
+    ht_array* array = atomic_load(&shard->array);
+    size_t base = 0;
+    for (; array != NULL; base += array->used, array = array->next) {
+      while (it->_index - base < array->used) {
+        size_t i = it->_index - base;
+        it->_index++;
+        void* value = array->entries[i].value;
+        if (array->live[i] && value != NULL
+            && (array->ref == NULL || !ht_expired(array, i, now))) {
+          // Found next non-empty item, update iterator key and value.
+          it->key = ht_entry_key(&array->entries[i]);
+          it->key_len = array->entries[i].key_len;
+          it->value = value;
+          pthread_mutex_unlock(&shard->mtx);
+          return true;
+        }
+      }
+    }
+    pthread_mutex_unlock(&shard->mtx);
+    it->_shard++;
+    it->_index = 0;
+  }
   return false;
 }
 
 int ht_remove(ht* table, const char* key) {
-  uint64_t hash = hash_key(key);
-  size_t index;
-  if (!table) return -1;
-  index = (size_t)(hash & (uint64_t)(table->capacity - 1));
-  pthread_mutex_lock(&table->mtx);
-  if (table->entries[index].key == NULL) {
-    pthread_mutex_unlock(&table->mtx);
+  return ht_remove_n(table, key, strlen(key));
+}
+
+int ht_remove_n(ht* table, const char* key, size_t len) {
+  if (!table || !ht_unshare(table)) return -1;
+  uint64_t hash = hash_key(table, key, len);
+  ht_shard* shard = ht_shard_for(table, hash);
+  ht_lock(shard);
+  ht_rehash_step(shard, REHASH_STEP);
+  size_t i;
+  ht_array* array = ht_find_all(atomic_load(&shard->array), key, len, hash,
+    &i);
+  if (array == NULL) {
+    pthread_mutex_unlock(&shard->mtx);
     return -1;
   }
-  while (table->entries[index].key != NULL) {
-    if (strcmp(key, table->entries[index].key) == 0) {
-      free((void*)table->entries[index].key);
-      table->length--;
-      pthread_mutex_unlock(&table->mtx);
-      return 0;
+  ht_delete(shard, array, i);
+  pthread_mutex_unlock(&shard->mtx);
+  return 0;
+}
+
+void** ht_get_or_insert(ht* table, const char* key, bool* inserted) {
+  return ht_get_or_insert_n(table, key, strlen(key), inserted);
+}
+
+void** ht_get_or_insert_n(ht* table, const char* key, size_t len,
+    bool* inserted) {
+  if (len > UINT32_MAX || !ht_unshare(table)) {
+    return NULL;
+  }
+  uint64_t hash = hash_key(table, key, len);
+  ht_shard* shard = ht_shard_for(table, hash);
+  ht_lock(shard);
+  size_t i;
+  bool added;
+  void** slot = NULL;
+  ht_array* array = ht_upsert(table, shard, key, len, hash, &i, &added);
+  if (array != NULL) {
+    // Same representation as void*; the caller's store publishes it.
+    slot = (void**)&array->entries[i].value;
+    if (inserted != NULL) {
+      *inserted = added;
+    }
+  }
+  pthread_mutex_unlock(&shard->mtx);
+  return slot;
+}
+
+int ht_update(ht* table, const char* key, ht_update_function fn,
+    void* ctx) {
+  return ht_update_n(table, key, strlen(key), fn, ctx);
+}
+
+int ht_update_n(ht* table, const char* key, size_t len,
+    ht_update_function fn, void* ctx) {
+  if (len > UINT32_MAX || !ht_unshare(table)) {
+    return -1;
+  }
+  uint64_t hash = hash_key(table, key, len);
+  ht_shard* shard = ht_shard_for(table, hash);
+  ht_lock(shard);
+  ht_rehash_step(shard, REHASH_STEP);
+  size_t i;
+  ht_array* array = ht_find_live(table, shard, key, len, hash, &i);
+  void* value = fn(array != NULL ? array->entries[i].value : NULL, ctx);
+
+  int ret = 0;
+  if (array != NULL && value == NULL) {
+    ht_delete(shard, array, i);
+  } else if (array != NULL) {
+    if (array->ref != NULL) {
+      __atomic_store_n(&array->ref[i], 1, __ATOMIC_RELAXED);
+    }
+    atomic_store_explicit(&array->entries[i].value, value,
+      memory_order_release);
+  } else if (value != NULL) {
+    ret = ht_put_locked(table, shard, key, len, hash, value, 0);
+  }
+  pthread_mutex_unlock(&shard->mtx);
+  return ret;
+}
+
+#define SCAN_CHUNK 65536  // entries per ht_for_each_parallel job
+#define ACC_ALIGN 64      // accumulators start on cache lines of their own
+
+// State shared by the chunks of one ht_for_each_parallel scan.
+typedef struct {
+  ht_visit_function fn;
+  void* ctx;
+  ht_snap* snap;         // mapped image being scanned, or NULL
+  uint64_t now;          // expiry time base for cache tables
+  size_t pending;        // chunks not finished yet
+  pthread_mutex_t mtx;   // guards pending
+  pthread_cond_t done;   // signalled when pending drops to 0
+} ht_scan;
+
+// A range of entries of one array, or of slots of the mapped image if
+// array is NULL, and its accumulator.
+typedef struct {
+  ht_scan* scan;
+  ht_array* array;
+  size_t start;
+  size_t end;
+  void* acc;
+} ht_chunk;
+
+// Visit the items of a chunk, skipping those ht_next does; runs on a
+// pool thread.
+static void ht_scan_chunk(void* arg) {
+  ht_chunk* chunk = arg;
+  ht_scan* scan = chunk->scan;
+  ht_array* array = chunk->array;
+  for (size_t i = chunk->start; i < chunk->end; i++) {
+    if (array != NULL) {
+      ht_entry* entry = &array->entries[i];
+      void* value = entry->value;
+      if (array->live[i] && value != NULL
+          && (array->ref == NULL || !ht_expired(array, i, scan->now))) {
+        scan->fn(ht_entry_key(entry), entry->key_len, value, scan->ctx,
+          chunk->acc);
+      }
+    } else {
+      ht_snap* snap = scan->snap;
+      const char* base = (const char*)snap;
+      if ((uint8_t)base[snap->ctrl_off + i] & CTRL_FULL) {
+        const ht_snap_slot* slot =
+          (const ht_snap_slot*)(base + snap->slots_off) + i;
+        scan->fn(base + slot->key_off, slot->key_len,
+          (void*)(base + slot->value_off), scan->ctx, chunk->acc);
+      }
+    }
+  }
+
+  pthread_mutex_lock(&scan->mtx);
+  if (--scan->pending == 0) {
+    pthread_cond_signal(&scan->done);
+  }
+  pthread_mutex_unlock(&scan->mtx);
+}
+
+// Append chunks covering count entries of array (or slots of the image,
+// if NULL) to chunks[*n...].
+static void ht_add_chunks(ht_chunk* chunks, size_t* n, ht_scan* scan,
+    ht_array* array, size_t count) {
+  for (size_t start = 0; start < count; start += SCAN_CHUNK) {
+    size_t end = count - start < SCAN_CHUNK ? count : start + SCAN_CHUNK;
+    chunks[(*n)++] = (ht_chunk){scan, array, start, end, NULL};
+  }
+}
+
+int ht_for_each_parallel(ht* table, threadpool pool, ht_visit_function fn,
+    void* ctx, size_t acc_size, ht_merge_function merge) {
+  // Hold every lock a writer could take, so slots stay put.
+  pthread_mutex_lock(&table->snap_mtx);
+  for (size_t s = 0; s < table->nshards; s++) {
+    ht_lock(&table->shards[s]);
+  }
+
+  // Cut the image, or each shard's arrays, into chunks.
+  ht_snap* snap = atomic_load(&table->snap);
+  size_t nchunks = 0;
+  if (snap != NULL) {
+    nchunks = (snap->capacity + SCAN_CHUNK - 1) / SCAN_CHUNK;
+  } else {
+    for (size_t s = 0; s < table->nshards; s++) {
+      for (ht_array* array = atomic_load(&table->shards[s].array);
+          array != NULL; array = array->next) {
+        nchunks += (array->used + SCAN_CHUNK - 1) / SCAN_CHUNK;
+      }
+    }
+  }
+  // Round accumulators up to whole cache lines, so chunks running on
+  // different threads never write to the same line.
+  size_t acc_stride = (acc_size + ACC_ALIGN - 1) / ACC_ALIGN * ACC_ALIGN;
+  size_t accs_size = nchunks * acc_stride != 0 ? nchunks * acc_stride
+    : ACC_ALIGN;
+  ht_chunk* chunks = malloc(nchunks * sizeof(ht_chunk));
+  char* accs = NULL;
+  if (acc_stride == 0 || nchunks <= SIZE_MAX / acc_stride) {
+    accs = aligned_alloc(ACC_ALIGN, accs_size);
+  }
+  if (accs != NULL) {
+    memset(accs, 0, accs_size);
+  }
+  ht_scan scan = {fn, ctx, snap, 0, nchunks, PTHREAD_MUTEX_INITIALIZER,
+    PTHREAD_COND_INITIALIZER};
+  int ret = -1;
+  if (nchunks != 0 && (chunks == NULL || accs == NULL)) {
+    goto done;  // (an empty table may have no chunks)
+  }
+  if (table->shards[0].max_length != 0) {
+    scan.now = ht_now_ms();
+  }
+
+  size_t n = 0;
+  if (snap != NULL) {
+    ht_add_chunks(chunks, &n, &scan, NULL, snap->capacity);
+  } else {
+    for (size_t s = 0; s < table->nshards; s++) {
+      for (ht_array* array = atomic_load(&table->shards[s].array);
+          array != NULL; array = array->next) {
+        ht_add_chunks(chunks, &n, &scan, array, array->used);
+      }
+    }
+  }
+  for (size_t c = 0; c < nchunks; c++) {
+    chunks[c].acc = acc_size != 0 ? accs + c * acc_stride : NULL;
+    // If the pool won't take the job, run it here.
+    if (thpool_add_work(pool, ht_scan_chunk, &chunks[c]) != 0) {
+      ht_scan_chunk(&chunks[c]);
+    }
+  }
+
+  // Wait for the chunks, then merge their results in order.
+  pthread_mutex_lock(&scan.mtx);
+  while (scan.pending != 0) {
+    pthread_cond_wait(&scan.done, &scan.mtx);
+  }
+  pthread_mutex_unlock(&scan.mtx);
+  if (merge != NULL) {
+    for (size_t c = 0; c < nchunks; c++) {
+      merge(ctx, chunks[c].acc);
+    }
+  }
+  ret = 0;
+
+done:
+  for (size_t s = table->nshards; s-- > 0;) {
+    pthread_mutex_unlock(&table->shards[s].mtx);
+  }
+  pthread_mutex_unlock(&table->snap_mtx);
+  pthread_cond_destroy(&scan.done);
+  pthread_mutex_destroy(&scan.mtx);
+  free(accs);
+  free(chunks);
+  return ret;
+}
+
+#define BUILD_CHUNK 65536  // keys per ht_build_parallel hashing job
+#define BUILD_SHARDS 64    // shards of a large ht_build_parallel table
+
+// An item sorted into its shard's run by ht_build_parallel, with all
+// filling the shard needs, so that reads the runs in order.
+typedef struct {
+  const char* key;
+  void* value;
+  uint64_t hash;
+} ht_build_item;
+
+// State shared by the jobs of one ht_build_parallel. Keys are hashed and
+// counted per shard by chunk, then sorted by shard (each chunk writing
+// its items to the positions its counts reserved), then each shard is
+// filled by a job of its own. The table isn't visible to anyone else
+// yet, so no job takes a lock.
+typedef struct {
+  ht* table;
+  const char* const* keys;
+  void* const* values;
+  size_t n;
+  size_t nchunks;
+  uint64_t* hashes;      // per key
+  ht_build_item* items;  // sorted by shard
+  size_t* counts;        // per chunk and shard: keys, then sort position
+  size_t* starts;        // per shard: first of its items
+  atomic_bool failed;    // a key was invalid, or out of memory
+  size_t pending;        // jobs of the current phase not finished yet
+  pthread_mutex_t mtx;   // guards pending
+  pthread_cond_t done;   // signalled when pending drops to 0
+} ht_build;
+
+// A chunk of keys, or a shard, for a job of ht_build_parallel.
+typedef struct {
+  ht_build* build;
+  size_t index;
+} ht_build_job;
+
+// Mark a job of the current phase finished.
+static void ht_build_done(ht_build* build) {
+  pthread_mutex_lock(&build->mtx);
+  if (--build->pending == 0) {
+    pthread_cond_signal(&build->done);
+  }
+  pthread_mutex_unlock(&build->mtx);
+}
+
+// Hash the keys of a chunk and count them per shard.
+static void ht_build_hash(void* arg) {
+  ht_build_job* job = arg;
+  ht_build* build = job->build;
+  ht* table = build->table;
+  size_t* counts = &build->counts[job->index * table->nshards];
+  size_t start = job->index * BUILD_CHUNK;
+  size_t end = build->n - start < BUILD_CHUNK ? build->n : start + BUILD_CHUNK;
+  for (size_t k = start; k < end; k++) {
+    assert(build->values[k] != NULL);
+    size_t len = strlen(build->keys[k]);
+    if (build->values[k] == NULL || len > UINT32_MAX) {
+      atomic_store(&build->failed, true);
+      break;
+    }
+    build->hashes[k] = hash_key(table, build->keys[k], len);
+    counts[ht_shard_for(table, build->hashes[k]) - table->shards]++;
+  }
+  ht_build_done(build);
+}
+
+// Write the items of a chunk to their positions, keeping them in input
+// order within each shard (so later duplicates win, as with ht_set).
+static void ht_build_sort(void* arg) {
+  ht_build_job* job = arg;
+  ht_build* build = job->build;
+  ht* table = build->table;
+  size_t* pos = &build->counts[job->index * table->nshards];
+  size_t start = job->index * BUILD_CHUNK;
+  size_t end = build->n - start < BUILD_CHUNK ? build->n : start + BUILD_CHUNK;
+  for (size_t k = start; k < end; k++) {
+    uint64_t hash = build->hashes[k];
+    build->items[pos[ht_shard_for(table, hash) - table->shards]++] =
+      (ht_build_item){build->keys[k], build->values[k], hash};
+  }
+  ht_build_done(build);
+}
+
+// Size a shard to fit its keys, then insert them.
+static void ht_build_fill(void* arg) {
+  ht_build_job* job = arg;
+  ht_build* build = job->build;
+  ht* table = build->table;
+  ht_shard* shard = &table->shards[job->index];
+  size_t first = build->starts[job->index];
+  size_t last = build->starts[job->index + 1];
+  if (last - first >= INITIAL_CAPACITY / 8 * 7) {
+    if (!ht_resize(shard, ht_capacity_fit(last - first), false)) {
+      atomic_store(&build->failed, true);
+      ht_build_done(build);
+      return;
+    }
+    ht_rehash_step(shard, SIZE_MAX);
+  }
+  for (const ht_build_item* item = &build->items[first];
+      item != &build->items[last]; item++) {
+    if (ht_put_locked(table, shard, item->key, strlen(item->key),
+        item->hash, item->value, 0) != 0) {
+      atomic_store(&build->failed, true);
+      break;
+    }
+  }
+  ht_build_done(build);
+}
+
+// Run fn as njobs jobs on pool (or here, if the pool won't take one) and
+// wait for them all.
+static void ht_build_run(ht_build* build, threadpool pool,
+    void (*fn)(void*), ht_build_job* jobs, size_t njobs) {
+  build->pending = njobs;
+  for (size_t j = 0; j < njobs; j++) {
+    jobs[j] = (ht_build_job){build, j};
+    if (thpool_add_work(pool, fn, &jobs[j]) != 0) {
+      fn(&jobs[j]);
+    }
+  }
+  pthread_mutex_lock(&build->mtx);
+  while (build->pending != 0) {
+    pthread_cond_wait(&build->done, &build->mtx);
+  }
+  pthread_mutex_unlock(&build->mtx);
+}
+
+ht* ht_build_parallel(threadpool pool, const char* const* keys,
+    void* const* values, size_t n) {
+  // Enough shards to keep every thread busy filling them, but no more
+  // than there are chunks of keys to spread over them.
+  size_t nshards = 1;
+  while (nshards < BUILD_SHARDS && nshards * BUILD_CHUNK < n) {
+    nshards *= 2;
+  }
+  ht_build build = {NULL, keys, values, n, (n + BUILD_CHUNK - 1) / BUILD_CHUNK,
+    NULL, NULL, NULL, NULL, false, 0, PTHREAD_MUTEX_INITIALIZER,
+    PTHREAD_COND_INITIALIZER};
+  size_t njobs = build.nchunks > nshards ? build.nchunks : nshards;
+  ht_build_job* jobs = malloc(njobs * sizeof(ht_build_job));
+  build.table = ht_create_sharded(nshards);
+  build.hashes = malloc(n * sizeof(uint64_t));
+  build.items = malloc(n * sizeof(ht_build_item));
+  build.counts = calloc(build.nchunks * nshards, sizeof(size_t));
+  build.starts = malloc((nshards + 1) * sizeof(size_t));
+  if (jobs == NULL || build.table == NULL || build.starts == NULL
+      || (n != 0 && (build.hashes == NULL || build.items == NULL
+        || build.counts == NULL))) {
+    atomic_store(&build.failed, true);  // (no keys need no scratch)
+    goto done;
+  }
+
+  ht_build_run(&build, pool, ht_build_hash, jobs, build.nchunks);
+  if (atomic_load(&build.failed)) {
+    goto done;
+  }
+  // Turn the counts into each chunk's first position in each shard's run
+  // of items, chunks in input order.
+  size_t pos = 0;
+  for (size_t s = 0; s < nshards; s++) {
+    build.starts[s] = pos;
+    for (size_t c = 0; c < build.nchunks; c++) {
+      size_t count = build.counts[c * nshards + s];
+      build.counts[c * nshards + s] = pos;
+      pos += count;
+    }
+  }
+  build.starts[nshards] = pos;
+  ht_build_run(&build, pool, ht_build_sort, jobs, build.nchunks);
+  ht_build_run(&build, pool, ht_build_fill, jobs, nshards);
+
+done:
+  if (atomic_load(&build.failed) && build.table != NULL) {
+    ht_destroy(build.table);
+    build.table = NULL;
+  }
+  pthread_cond_destroy(&build.done);
+  pthread_mutex_destroy(&build.mtx);
+  free(build.starts);
+  free(build.counts);
+  free(build.items);
+  free(build.hashes);
+  free(jobs);
+  return build.table;
+}
+
+// Count item with given hash found in slot i of a table of capacity slots
+// into stats: how many groups its lookup probes, retracing the sequence
+// from its home group.
+static void ht_stats_probe(hts* stats, size_t capacity, uint64_t hash,
+    size_t i) {
+  size_t mask = capacity / GROUP_WIDTH - 1;
+  size_t group = (size_t)(hash >> 7) & mask;
+  size_t probes = 1;
+  while (group != i / GROUP_WIDTH) {
+    group = (group + probes) & mask;
+    probes++;
+  }
+  stats->probe_histogram[probes < HT_STATS_PROBES ? probes - 1
+    : HT_STATS_PROBES - 1]++;
+  stats->mean_probe += (double)probes;
+  if (probes > stats->max_probe) {
+    stats->max_probe = probes;
+  }
+}
+
+void ht_stats(ht* table, hts* stats) {
+  memset(stats, 0, sizeof(*stats));
+  stats->nshards = table->nshards;
+  size_t items = 0;
+
+  // Slots of a mapped image still in use...
+  pthread_mutex_lock(&table->snap_mtx);
+  ht_snap* snap = atomic_load(&table->snap);
+  if (snap != NULL) {
+    const char* base = (const char*)snap;
+    const ht_snap_slot* slots = (const ht_snap_slot*)(base + snap->slots_off);
+    stats->capacity += snap->capacity;
+    for (size_t i = 0; i < snap->capacity; i++) {
+      if ((uint8_t)base[snap->ctrl_off + i] & CTRL_FULL) {
+        ht_stats_probe(stats, snap->capacity, slots[i].hash, i);
+        items++;
+      }
+    }
+  }
+  pthread_mutex_unlock(&table->snap_mtx);
+
+  // ...then of each shard's arrays, one shard locked at a time (the
+  // locking isn't counted).
+  for (size_t s = 0; s < table->nshards; s++) {
+    ht_shard* shard = &table->shards[s];
+    pthread_mutex_lock(&shard->mtx);
+    for (ht_array* array = atomic_load(&shard->array); array != NULL;
+        array = array->next) {
+      stats->capacity += array->capacity;
+      for (size_t i = 0; i < array->capacity; i++) {
+        if (array->ctrl[i] & CTRL_FULL) {
+          ht_stats_probe(stats, array->capacity,
+            array->entries[ht_index_get(array, i)].hash, i);
+          items++;
+        } else if (array->ctrl[i] == CTRL_DELETED) {
+          stats->deleted++;
+        }
+      }
+    }
+    stats->expansions += shard->expansions;
+    stats->rehash_ns += shard->rehash_ns;
+    stats->locks += shard->locks;
+    stats->lock_waits += shard->lock_waits;
+    stats->reseeds += shard->reseeds;
+    pthread_mutex_unlock(&shard->mtx);
+  }
+
+  stats->length = items;
+  if (stats->capacity != 0) {
+    stats->load_factor = (double)items / (double)stats->capacity;
+  }
+  if (items != 0) {
+    stats->mean_probe /= (double)items;
+  }
+}
+
+// Return value of key in snapshot, or NULL if not found.
+static void* ht_snap_get(ht_snap* snap, const char* key, size_t len,
+    uint64_t hash) {
+  const char* base = (const char*)snap;
+  const uint8_t* ctrl = (const uint8_t*)base + snap->ctrl_off;
+  const ht_snap_slot* slots = (const ht_snap_slot*)(base + snap->slots_off);
+  uint8_t tag = HT_TAG(hash);
+  size_t group = HT_PROBE_START(snap, hash);
+  size_t ngroups = snap->capacity / GROUP_WIDTH;
+
+  for (size_t step = 1; step <= ngroups; step++) {
+    for (uint32_t m = ht_match(&ctrl[group * GROUP_WIDTH], tag); m != 0;
+        m &= m - 1) {
+      const ht_snap_slot* slot =
+        &slots[group * GROUP_WIDTH + (size_t)__builtin_ctz(m)];
+      if (slot->hash == hash && slot->key_len == len
+          && memcmp(key, base + slot->key_off, len) == 0) {
+        return (void*)(base + slot->value_off);
+      }
+    }
+    if (ht_match(&ctrl[group * GROUP_WIDTH], CTRL_EMPTY) != 0) {
+      break;
     }
+    group = HT_PROBE_NEXT(snap, group, step);
+  }
+  return NULL;
+}
+
+// Copy keys of a mapped image into the table's own storage, so it can be
+// modified; values keep pointing into the mapping. Like ht_bulk_insert,
+// sorts the image's slots by shard first, so each shard is sized once to
+// fit its keys and filled under one lock, without rehashing. Writers wait
+// for the copy. Return false if out of memory.
+static bool ht_unshare(ht* table) {
+  if (atomic_load_explicit(&table->snap, memory_order_acquire) == NULL) {
+    return true;
+  }
+  pthread_mutex_lock(&table->snap_mtx);
+  ht_snap* snap = atomic_load(&table->snap);
+  if (snap == NULL) {
+    pthread_mutex_unlock(&table->snap_mtx);
+    return true;
+  }
+  const char* base = (const char*)snap;
+  const ht_snap_slot* slots = (const ht_snap_slot*)(base + snap->slots_off);
+  size_t* starts = calloc(table->nshards + 1, sizeof(size_t));
+  size_t* order = NULL;
+  size_t n = 0;
+  bool ok = false;
+  if (starts == NULL) {
+    goto done;
+  }
+  // Count the image's keys by shard (the image stores their hashes)...
+  for (size_t i = 0; i < snap->capacity; i++) {
+    if ((uint8_t)base[snap->ctrl_off + i] & CTRL_FULL) {
+      starts[ht_shard_for(table, slots[i].hash) - table->shards + 1]++;
+      n++;
+    }
+  }
+  for (size_t s = 0; s < table->nshards; s++) {
+    starts[s + 1] += starts[s];
+  }
+  // ...and list their slots shard by shard.
+  order = malloc((n != 0 ? n : 1) * sizeof(size_t));
+  if (order == NULL) {
+    goto done;
+  }
+  for (size_t i = 0; i < snap->capacity; i++) {
+    if ((uint8_t)base[snap->ctrl_off + i] & CTRL_FULL) {
+      order[starts[ht_shard_for(table, slots[i].hash) - table->shards]++] = i;
+    }
+  }
+  memmove(starts + 1, starts, table->nshards * sizeof(size_t));
+  starts[0] = 0;
+
+  ok = true;
+  for (size_t s = 0; s < table->nshards && ok; s++) {
+    ht_shard* shard = &table->shards[s];
+    size_t count = starts[s + 1] - starts[s];
+    ht_lock(shard);
+    // Grow once to fit them; if that fails, inserts still grow as needed.
+    ht_array* array = ht_newest(shard);
+    if (array->used + count >= array->capacity / 8 * 7
+        && ht_resize(shard, ht_capacity_fit(shard->length + count), false)) {
+      ht_rehash_step(shard, SIZE_MAX);
+    }
+    for (size_t j = starts[s]; j < starts[s + 1]; j++) {
+      const ht_snap_slot* slot = &slots[order[j]];
+      if (ht_put_locked(table, shard, base + slot->key_off, slot->key_len,
+          slot->hash, (void*)(base + slot->value_off), 0) != 0) {
+        ok = false;
+        break;
+      }
+    }
+    pthread_mutex_unlock(&shard->mtx);
+  }
+  if (ok) {
+    // Readers switch to the shards once they hold everything.
+    atomic_store_explicit(&table->snap, NULL, memory_order_release);
+  }
+
+done:
+  pthread_mutex_unlock(&table->snap_mtx);
+  free(order);
+  free(starts);
+  return ok;
+}
+
+int ht_save(ht* table, const char* path,
+    size_t (*value_size)(const void* value)) {
+  // Size the image for the current items at up to 7/8 load.
+  ht_snap header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, SNAP_MAGIC, sizeof(header.magic));
+  header.capacity = INITIAL_CAPACITY;
+  while (header.capacity / 8 * 7 < ht_length(table)) {
+    header.capacity *= 2;
+  }
+  header.nshards = table->nshards;
+  header.seed = table->seed;
+  header.hash_check = table->hash(SNAP_MAGIC, sizeof(header.magic),
+    table->seed);
+  header.ctrl_off = sizeof(ht_snap);
+  header.slots_off = header.ctrl_off + header.capacity;
+  uint64_t offset = header.slots_off + header.capacity * sizeof(ht_snap_slot);
+
+  // Write a new file next to path and rename it over path at the end:
+  // truncating path in place would pull pages from under anyone mapping
+  // it, such as a table opened from it with ht_open_mapped.
+  int ret = -1;
+  uint8_t* ctrl = calloc(header.capacity, 1);
+  ht_snap_slot* slots = calloc(header.capacity, sizeof(ht_snap_slot));
+  size_t tmp_size = strlen(path) + 32;
+  char* tmp = malloc(tmp_size);
+  FILE* f = NULL;
+  if (tmp != NULL) {
+    snprintf(tmp, tmp_size, "%s.%ld.tmp", path, (long)getpid());
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL, 0666);
+    if (fd >= 0 && (f = fdopen(fd, "wb")) == NULL) {
+      close(fd);
+      unlink(tmp);
+    }
+  }
+  if (ctrl == NULL || slots == NULL || f == NULL
+      || fseeko(f, (off_t)offset, SEEK_SET) != 0) {
+    goto done;
+  }
+
+  // Append each item's key and value bytes, and slot it into the image.
+  static const char zeros[SNAP_ALIGN];
+  hti it = ht_iterator(table);
+  while (ht_next(&it)) {
+    size_t value_len = value_size != NULL ? value_size(it.value)
+      : strlen(it.value) + 1;
+    if (header.length == header.capacity / 8 * 7 || value_len > UINT32_MAX) {
+      goto done;  // table grew while saving, or value too big
+    }
+    // Pad after the key, so the value is aligned when the file is mapped.
+    size_t pad = (SNAP_ALIGN - (offset + it.key_len + 1) % SNAP_ALIGN)
+      % SNAP_ALIGN;
+    if (fwrite(it.key, 1, it.key_len + 1, f) != it.key_len + 1
+        || fwrite(zeros, 1, pad, f) != pad
+        || fwrite(it.value, 1, value_len, f) != value_len) {
+      goto done;
+    }
+
+    uint64_t hash = hash_key(table, it.key, it.key_len);
+    size_t group = HT_PROBE_START(&header, hash);
+    uint32_t m;
+    for (size_t step = 1;
+        (m = ht_match(&ctrl[group * GROUP_WIDTH], CTRL_EMPTY)) == 0; step++) {
+      group = HT_PROBE_NEXT(&header, group, step);
+    }
+    size_t i = group * GROUP_WIDTH + (size_t)__builtin_ctz(m);
+    ctrl[i] = HT_TAG(hash);
+    slots[i].hash = hash;
+    slots[i].key_off = offset;
+    slots[i].key_len = (uint32_t)it.key_len;
+    slots[i].value_off = offset + it.key_len + 1 + pad;
+    slots[i].value_len = (uint32_t)value_len;
+    offset = slots[i].value_off + value_len;
+    header.length++;
+  }
+  header.size = offset;
+
+  // Then fill in the header, control bytes and slots in front.
+  if (fseeko(f, 0, SEEK_SET) == 0
+      && fwrite(&header, sizeof(header), 1, f) == 1
+      && fwrite(ctrl, 1, header.capacity, f) == header.capacity
+      && fwrite(slots, sizeof(ht_snap_slot), header.capacity, f)
+        == header.capacity
+      && fflush(f) == 0 && fsync(fileno(f)) == 0) {
+    ret = 0;
+  }
+
+done:
+  if (f != NULL) {
+    if (fclose(f) != 0) {
+      ret = -1;
+    }
+    if (ret == 0 && rename(tmp, path) != 0) {
+      ret = -1;
+    }
+    if (ret != 0) {
+      unlink(tmp);
+    }
+  }
+  free(tmp);
+  free(slots);
+  free(ctrl);
+  return ret;
+}
+
+// Return true if every item of image lies within its size bytes, with
+// NUL-terminated keys and aligned values; the header must be checked
+// first.
+static bool ht_snap_valid(const ht_snap* snap, size_t size) {
+  const char* base = (const char*)snap;
+  const ht_snap_slot* slots = (const ht_snap_slot*)(base + snap->slots_off);
+  for (size_t i = 0; i < snap->capacity; i++) {
+    const ht_snap_slot* slot = &slots[i];
+    if (!((uint8_t)base[snap->ctrl_off + i] & CTRL_FULL)) {
+      continue;
+    }
+    if (slot->key_off > size || slot->key_len >= size - slot->key_off
+        || base[slot->key_off + slot->key_len] != '\0'
+        || slot->value_off > size || slot->value_len > size - slot->value_off
+        || slot->value_off % SNAP_ALIGN != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+ht* ht_open_mapped(const char* path, hash_function hash) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return NULL;
+  }
+  struct stat st;
+  void* map = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(ht_snap)) {
+    map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if (map == MAP_FAILED) {
+    return NULL;
+  }
+
+  // Check the image is one ht_save wrote with the same hash function.
+  ht_snap* snap = map;
+  size_t size = (size_t)st.st_size;
+  hash_function h = (hash == NULL) ? &hash_wyhash : hash;
+  ht* table = NULL;
+  if (memcmp(snap->magic, SNAP_MAGIC, sizeof(snap->magic)) == 0
+      && snap->size == size
+      && snap->capacity >= GROUP_WIDTH
+      && (snap->capacity & (snap->capacity - 1)) == 0
+      && snap->ctrl_off == sizeof(ht_snap)
+      && snap->capacity <= size
+      && snap->slots_off == snap->ctrl_off + snap->capacity
+      && snap->slots_off <= size
+      && snap->capacity <= (size - snap->slots_off) / sizeof(ht_snap_slot)
+      && snap->hash_check == h(SNAP_MAGIC, sizeof(snap->magic), snap->seed)
+      && ht_snap_valid(snap, size)) {
+    table = ht_create_with_hash(snap->nshards, h);
+  }
+  if (table == NULL) {
+    munmap(map, size);
+    return NULL;
   }
-  pthread_mutex_unlock(&table->mtx);
-  return -1;
+  table->seed = snap->seed;
+  table->snap_map = map;
+  table->snap_size = size;
+  atomic_store(&table->snap, snap);
+  return table;
 }
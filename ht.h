@@ -6,36 +6,154 @@
 #include <stdbool.h>
 #include <stddef.h>
 
+#include "hash.h"
+#include "thpool.h"
+
 // Hash table structure: create with ht_create, free with ht_destroy.
 typedef struct ht ht;
 
 // Create hash table and return pointer to it, or NULL if out of memory.
 ht* ht_create(void);
 
+// Create hash table split into nshards independently locked sub-tables
+// (rounded up to a power of two), so that threads working on keys in
+// different shards never contend. Each shard resizes on its own. Return
+// pointer to it, or NULL if out of memory.
+ht* ht_create_sharded(size_t nshards);
+
+// Create sharded hash table (see ht_create_sharded) that hashes keys
+// with given hash function, e.g. hash_fnv1a, or hash_wyhash if NULL.
+ht* ht_create_with_hash(size_t nshards, hash_function hash);
+
+// Create sharded hash table (see ht_create_sharded) that hashes keys
+// with hash_siphash13 under a random per-table seed, for keys chosen by
+// untrusted clients: without the seed they can't pick keys that collide.
+// Any table also guards against such keys in a milder way: a shard where
+// an insert has to probe unusually far is rehashed, placing its keys by
+// hash_siphash13 under a fresh random seed (see hts.reseeds). Return
+// pointer to table, or NULL if out of memory.
+ht* ht_create_keyed(size_t nshards);
+
+// Create sharded hash table (see ht_create_sharded) sized up front to
+// hold n items without rehashing, for loading a dataset of known size.
+// Return pointer to it, or NULL if out of memory.
+ht* ht_create_with_capacity(size_t nshards, size_t n);
+
+// Called with each item a cache table evicts (see ht_create_cache), e.g.
+// to free its value. Runs under a lock of the table, so it must not call
+// back into it; key is only valid during the call.
+typedef void (*ht_evict_function)(const char* key, size_t key_len,
+    void* value, void* ctx);
+
+// Create sharded hash table (see ht_create_sharded) that holds at most
+// about max_entries items, for use as a cache. Setting a new key in a
+// full shard first evicts an expired item (see ht_set_ttl) or one not
+// read recently, picked with the CLOCK approximation of LRU, and calls
+// evict (unless NULL) with it and ctx; expired items are also passed to
+// it when their key is next written. Items removed with ht_remove, or
+// replaced with ht_set before they expire, aren't passed to evict.
+// Return pointer to table, or NULL if out of memory or max_entries is 0.
+ht* ht_create_cache(size_t nshards, size_t max_entries,
+    ht_evict_function evict, void* ctx);
+
 // Free memory allocated for hash table, including allocated keys.
 void ht_destroy(ht* table);
 
 // Get item with given key (NUL-terminated) from hash table. Return
-// value (which was set with ht_set), or NULL if key not found.
+// value (which was set with ht_set), or NULL if key not found. Normally
+// takes no lock, so lookups don't wait for concurrent writers (a thread
+// falls back to its key's shard lock if out of memory for its reader
+// record, allocated on its first lookup).
 void* ht_get(ht* table, const char* key);
 
+// Get item with given key of len bytes, which may contain NULs and
+// needn't be NUL-terminated. Otherwise same as ht_get.
+void* ht_get_n(ht* table, const char* key, size_t len);
+
+// Look up n keys (NUL-terminated) at once, storing each one's value, or
+// NULL if not found, in values[0..n-1]. Hashes a batch of keys first and
+// prefetches their slots, so the cache misses of large tables overlap
+// instead of being paid one after another. Return number of keys found.
+size_t ht_get_many(ht* table, const char* const* keys, size_t n,
+    void** values);
+
+// Same as ht_get_many for keys of lens[0..n-1] bytes (see ht_get_n), or
+// NUL-terminated keys if lens is NULL.
+size_t ht_get_many_n(ht* table, const char* const* keys, const size_t* lens,
+    size_t n, void** values);
+
 // Set item with given key (NUL-terminated) to value (which must not
-// be NULL). If not already present in table, key is copied to newly
-// allocated memory (keys are freed automatically when ht_destroy is
-// called). Return address of copied key, or NULL if out of memory.
+// be NULL). If not already present in table, key is copied into the
+// table: short keys are stored inline in the slot, longer ones in newly
+// allocated memory (freed automatically when ht_destroy is called).
+// Return 0 on success, or -1 if out of memory.
 int ht_set(ht* table, const char* key, void* value);
 
-// Return number of items in hash table.
+// Set item with given key of len bytes (see ht_get_n). The stored copy
+// gets a terminating NUL, so iterators can hand it out as a string.
+int ht_set_n(ht* table, const char* key, size_t len, void* value);
+
+// Return pointer to the value of item with given key (NUL-terminated),
+// first adding the item with a NULL value if it's not in the table, and
+// set *inserted (unless NULL) to whether it was added, so a
+// read-modify-write such as counting hashes and probes only once. The
+// caller must store a non-NULL value in a new item: until then, ht_get,
+// ht_next, ht_for_each_parallel and ht_save skip it, though ht_length
+// counts it. The pointer is valid until the table is next modified, so
+// with concurrent writers use ht_update instead. Return NULL if out of
+// memory.
+void** ht_get_or_insert(ht* table, const char* key, bool* inserted);
+
+// Same as ht_get_or_insert for key of len bytes (see ht_get_n).
+void** ht_get_or_insert_n(ht* table, const char* key, size_t len,
+    bool* inserted);
+
+// Called by ht_update with key's current value (NULL if not present) and
+// ctx; returns its new value, or NULL to remove the item.
+typedef void* (*ht_update_function)(void* value, void* ctx);
+
+// Set item with given key (NUL-terminated) to what fn returns for its
+// current value, holding the lock of key's shard throughout, so updates
+// from several threads don't race. fn must not call back into the table.
+// Return 0 on success, or -1 if out of memory.
+int ht_update(ht* table, const char* key, ht_update_function fn,
+    void* ctx);
+
+// Same as ht_update for key of len bytes (see ht_get_n).
+int ht_update_n(ht* table, const char* key, size_t len,
+    ht_update_function fn, void* ctx);
+
+// Set item like ht_set in a table created with ht_create_cache, expiring
+// it ttl_ms milliseconds from now (0 for never): from then on ht_get
+// returns NULL for it, iteration skips it, and it's evicted first.
+// Return 0 on success, or -1 if out of memory or not a cache table.
+int ht_set_ttl(ht* table, const char* key, void* value, uint64_t ttl_ms);
+
+// Same as ht_set_ttl for key of len bytes (see ht_get_n).
+int ht_set_ttl_n(ht* table, const char* key, size_t len, void* value,
+    uint64_t ttl_ms);
+
+// Set n items at once, keys[i] (NUL-terminated) to values[i], as if by
+// ht_set on each. All keys are hashed first and grouped by shard; then
+// each shard is locked once, grown once to fit its share and filled.
+// Return 0 on success, or -1 if out of memory (some items may be set).
+int ht_bulk_insert(ht* table, const char* const* keys, void* const* values,
+    size_t n);
+
+// Return number of items in hash table (for a cache table, this counts
+// expired items that haven't been evicted yet).
 size_t ht_length(ht* table);
 
 // Hash table iterator: create with ht_iterator, iterate with ht_next.
 typedef struct {
-  const char* key;  // current key
+  const char* key;  // current key, valid until the table is modified
+  size_t key_len;   // length of current key
   void* value;    // current value
 
   // Don't use these fields directly.
   ht* _table;     // reference to hash table being iterated
-  size_t _index;  // current index into ht._entries
+  size_t _shard;  // current shard of ht
+  size_t _index;  // current index into shard's _entries
 } hti;
 
 // Return new hash table iterator (for use with ht_next).
@@ -43,10 +161,100 @@ hti ht_iterator(ht* table);
 
 // Move iterator to next item in hash table, update iterator's key
 // and value to current item, and return true. If there are no more
-// items, return false. Don't call ht_set during iteration.
+// items, return false. Don't call ht_set during iteration. Items come
+// shard by shard, each shard's in insertion order (so with one shard,
+// the whole table is in insertion order).
 bool ht_next(hti* it);
 
-/* returns -1 on fail */
+// Called by ht_for_each_parallel for each item, with its ctx and the
+// accumulator of the chunk of entries the item is in.
+typedef void (*ht_visit_function)(const char* key, size_t key_len,
+    void* value, void* ctx, void* acc);
+
+// Called by ht_for_each_parallel to fold a chunk's accumulator into ctx.
+typedef void (*ht_merge_function)(void* ctx, void* acc);
+
+// Call fn for every item of the table, splitting its slots into chunks
+// run as jobs on pool. Each chunk gets its own acc_size bytes of zero'd
+// accumulator (acc is NULL if acc_size is 0), starting on a cache line
+// of its own, so fn can add to it without locking or false sharing; it's
+// aligned for any type. Once all chunks are done, merge (unless NULL) is
+// called with each accumulator in turn on the calling thread. Writers
+// wait until the scan is over (ht_get doesn't), so fn must not modify
+// the table, and this must not be called from a job running on pool.
+// Return 0 on success, or -1 if out of memory.
+int ht_for_each_parallel(ht* table, threadpool pool, ht_visit_function fn,
+    void* ctx, size_t acc_size, ht_merge_function merge);
+
+// Create a sharded hash table holding keys[i] (NUL-terminated) set to
+// values[i] for each of the n items, as if by ht_set on each in turn,
+// using the threads of pool: keys are hashed and sorted by shard in
+// chunks, then each shard is sized to fit its keys and filled by a job
+// of its own, without locking. Large inputs get 64 shards. Takes 32
+// bytes of scratch memory per item while building. Must not be called
+// from a job running on pool. Return pointer to table, or NULL if
+// out of memory or a value is NULL.
+ht* ht_build_parallel(threadpool pool, const char* const* keys,
+    void* const* values, size_t n);
+
+#define HT_STATS_PROBES 16  // buckets of hts.probe_histogram
+
+// Hash table statistics: fill in with ht_stats.
+typedef struct {
+  size_t nshards;
+  size_t length;      // items (including expired items of a cache)
+  size_t capacity;    // slots, of both arrays of shards being rehashed
+  size_t deleted;     // slots of removed items awaiting the next rehash
+  double load_factor;  // length / capacity
+  // Lookup cost of the items present, in groups of 16 slots probed
+  // (1 is the home group): histogram[i] counts items found at probe
+  // i + 1, the last bucket also those found any later.
+  double mean_probe;
+  size_t max_probe;
+  size_t probe_histogram[HT_STATS_PROBES];
+  // Counted since the table was created:
+  uint64_t expansions;  // rehashes started (growing, cleaning, shrinking)
+  uint64_t rehash_ns;   // time spent starting and running them
+  uint64_t locks;       // shard lock acquisitions by writers
+  uint64_t lock_waits;  // ...that had to wait for another thread
+  uint64_t reseeds;     // shards rehashed after keys piled up, see
+                        // ht_create_keyed
+} hts;
+
+// Fill in stats for table. Scans every slot, a shard at a time, so it
+// costs about as much as iterating the table; the counters it reports
+// are kept all the time at negligible cost.
+void ht_stats(ht* table, hts* stats);
+
+/* returns -1 on fail. The key's memory is released once no concurrent
+   ht_get can still be reading it. */
 int ht_remove(ht* table, const char* key);
 
+/* Remove item with given key of len bytes (see ht_get_n). */
+int ht_remove_n(ht* table, const char* key, size_t len);
+
+// Write an image of the table to file at path, for ht_open_mapped. Keys
+// and values are both copied into the file: value_size returns how many
+// bytes each value points to, or if NULL, values are taken to be
+// NUL-terminated strings. Don't modify the table while saving. The image
+// goes to a temporary file in the same directory (path.<pid>.tmp), synced
+// and then renamed over path, so path always holds a complete image, and
+// tables (or other processes) still mapping the old file keep working:
+// saving over the file a table was opened from is fine. Return 0 on
+// success, -1 on error.
+int ht_save(ht* table, const char* path,
+    size_t (*value_size)(const void* value));
+
+// Map image written by ht_save read-only and return a table using it
+// directly, so lookups work at once with no loading. Values returned
+// point into the mapping and must not be written to. The first ht_set
+// or ht_remove copies the keys into the table's own memory (values stay
+// mapped until ht_destroy), sizing each shard once to fit; writers wait
+// for the copy, roughly 0.15 s per million keys. hash must be the hash function of the saved
+// table (NULL for the default, hash_siphash13 for ht_create_keyed, whose
+// seed is kept in the image). Return NULL if the file can't be mapped
+// or isn't a valid image; every slot is bounds-checked, so opening reads
+// the slots once, but not the keys and values.
+ht* ht_open_mapped(const char* path, hash_function hash);
+
 #endif // _HT_H
@@ -0,0 +1,192 @@
+// Hash table keyed by 64-bit integers, a sibling of ht for ID maps.
+
+#include "ht_u64.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+// Hash table entry (slot is empty if value is NULL, so any key fits).
+typedef struct {
+  uint64_t key;
+  void* value;
+} ht_u64_entry;
+
+// Hash table structure: create with ht_u64_create, free with
+// ht_u64_destroy.
+struct ht_u64 {
+  ht_u64_entry* entries;  // hash slots
+  size_t capacity;  // size of _entries array, power of two
+  size_t length;    // number of items in hash table
+  pthread_mutex_t mtx;
+};
+
+#define INITIAL_CAPACITY 16  // must be a power of two
+
+ht_u64* ht_u64_create(void) {
+  // Allocate space for hash table struct.
+  ht_u64* table = malloc(sizeof(ht_u64));
+  if (table == NULL) {
+    return NULL;
+  }
+  table->length = 0;
+  table->capacity = INITIAL_CAPACITY;
+
+  // Allocate (zero'd, so all empty) space for entry buckets.
+  table->entries = calloc(table->capacity, sizeof(ht_u64_entry));
+  if (table->entries == NULL) {
+    free(table); // error, free table before we return!
+    return NULL;
+  }
+
+  if (pthread_mutex_init(&table->mtx, NULL) == 0) {
+    return table;
+  }
+  free(table->entries);
+  free(table);
+  return NULL;
+}
+
+void ht_u64_destroy(ht_u64* table) {
+  pthread_mutex_destroy(&table->mtx);
+  free(table->entries);
+  free(table);
+}
+
+// Return home slot of key. Mixes it with murmur3's 64-bit finaliser, so
+// sequential IDs spread over the table instead of filling one run.
+static inline size_t ht_u64_home(const ht_u64* table, uint64_t key) {
+  key ^= key >> 33;
+  key *= 0xff51afd7ed558ccdULL;
+  key ^= key >> 33;
+  key *= 0xc4ceb9fe1a85ec53ULL;
+  key ^= key >> 33;
+  return (size_t)key & (table->capacity - 1);
+}
+
+// Return index of slot holding key, or of the empty slot that ends its
+// probe run (linear probing). Caller holds lock.
+static size_t ht_u64_find(const ht_u64* table, uint64_t key) {
+  size_t mask = table->capacity - 1;
+  size_t i = ht_u64_home(table, key);
+  while (table->entries[i].value != NULL && table->entries[i].key != key) {
+    i = (i + 1) & mask;
+  }
+  return i;
+}
+
+// Move entries into a new array of given capacity. Return true on
+// success, false if out of memory.
+static bool ht_u64_resize(ht_u64* table, size_t capacity) {
+  ht_u64_entry* old_entries = table->entries;
+  size_t old_capacity = table->capacity;
+  ht_u64_entry* entries = calloc(capacity, sizeof(ht_u64_entry));
+  if (entries == NULL) {
+    return false;
+  }
+  table->entries = entries;
+  table->capacity = capacity;
+  for (size_t i = 0; i < old_capacity; i++) {
+    if (old_entries[i].value != NULL) {
+      table->entries[ht_u64_find(table, old_entries[i].key)] = old_entries[i];
+    }
+  }
+  free(old_entries);
+  return true;
+}
+
+void* ht_u64_get(ht_u64* table, uint64_t key) {
+  pthread_mutex_lock(&table->mtx);
+  void* value = table->entries[ht_u64_find(table, key)].value;
+  pthread_mutex_unlock(&table->mtx);
+  return value;
+}
+
+int ht_u64_set(ht_u64* table, uint64_t key, void* value) {
+  assert(value != NULL);
+  if (value == NULL) {
+    return -1;
+  }
+  pthread_mutex_lock(&table->mtx);
+  size_t i = ht_u64_find(table, key);
+  if (table->entries[i].value == NULL) {
+    // New key: if length will exceed 3/4 of capacity, expand it.
+    if (table->length >= table->capacity / 4 * 3) {
+      if (table->capacity > SIZE_MAX / 2 / sizeof(ht_u64_entry)
+          || !ht_u64_resize(table, table->capacity * 2)) {
+        pthread_mutex_unlock(&table->mtx);
+        return -1;
+      }
+      i = ht_u64_find(table, key);
+    }
+    table->entries[i].key = key;
+    table->length++;
+  }
+  table->entries[i].value = value;
+  pthread_mutex_unlock(&table->mtx);
+  return 0;
+}
+
+int ht_u64_remove(ht_u64* table, uint64_t key) {
+  pthread_mutex_lock(&table->mtx);
+  size_t hole = ht_u64_find(table, key);
+  if (table->entries[hole].value == NULL) {
+    pthread_mutex_unlock(&table->mtx);
+    return -1;
+  }
+
+  // Shift later entries of the run back into the hole, so no tombstones
+  // are needed: an entry moves if the hole is on its way from its home.
+  size_t mask = table->capacity - 1;
+  for (size_t i = (hole + 1) & mask; table->entries[i].value != NULL;
+      i = (i + 1) & mask) {
+    size_t home = ht_u64_home(table, table->entries[i].key);
+    if (((i - home) & mask) >= ((i - hole) & mask)) {
+      table->entries[hole] = table->entries[i];
+      hole = i;
+    }
+  }
+  table->entries[hole].value = NULL;
+  table->length--;
+
+  // Shrink once under 1/8 full (failing to is harmless).
+  if (table->capacity > INITIAL_CAPACITY
+      && table->length < table->capacity / 8) {
+    ht_u64_resize(table, table->capacity / 2);
+  }
+  pthread_mutex_unlock(&table->mtx);
+  return 0;
+}
+
+size_t ht_u64_length(ht_u64* table) {
+  pthread_mutex_lock(&table->mtx);
+  size_t length = table->length;
+  pthread_mutex_unlock(&table->mtx);
+  return length;
+}
+
+hti_u64 ht_u64_iterator(ht_u64* table) {
+  hti_u64 it;
+  it._table = table;
+  it._index = 0;
+  return it;
+}
+
+bool ht_u64_next(hti_u64* it) {
+  // Loop till we've hit end of entries array.
+  ht_u64* table = it->_table;
+  pthread_mutex_lock(&table->mtx);
+  while (it->_index < table->capacity) {
+    size_t i = it->_index;
+    it->_index++;
+    if (table->entries[i].value != NULL) {
+      // Found next non-empty item, update iterator key and value.
+      it->key = table->entries[i].key;
+      it->value = table->entries[i].value;
+      pthread_mutex_unlock(&table->mtx);
+      return true;
+    }
+  }
+  pthread_mutex_unlock(&table->mtx);
+  return false;
+}
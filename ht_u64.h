@@ -0,0 +1,55 @@
+// Hash table keyed by 64-bit integers, a sibling of ht for ID maps.
+
+#ifndef _HT_U64_H
+#define _HT_U64_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Hash table structure: create with ht_u64_create, free with
+// ht_u64_destroy. Keys are stored inline in the slots, so setting a key
+// never allocates memory of its own; all operations take one lock.
+typedef struct ht_u64 ht_u64;
+
+// Create hash table and return pointer to it, or NULL if out of memory.
+ht_u64* ht_u64_create(void);
+
+// Free memory allocated for hash table.
+void ht_u64_destroy(ht_u64* table);
+
+// Get item with given key from hash table. Return value (which was set
+// with ht_u64_set), or NULL if key not found.
+void* ht_u64_get(ht_u64* table, uint64_t key);
+
+// Set item with given key to value (which must not be NULL). Return 0 on
+// success, or -1 if out of memory.
+int ht_u64_set(ht_u64* table, uint64_t key, void* value);
+
+// Remove item with given key. Return 0 on success, or -1 if not found.
+int ht_u64_remove(ht_u64* table, uint64_t key);
+
+// Return number of items in hash table.
+size_t ht_u64_length(ht_u64* table);
+
+// Hash table iterator: create with ht_u64_iterator, iterate with
+// ht_u64_next.
+typedef struct {
+  uint64_t key;  // current key
+  void* value;   // current value
+
+  // Don't use these fields directly.
+  ht_u64* _table;  // reference to hash table being iterated
+  size_t _index;   // current index into _entries
+} hti_u64;
+
+// Return new hash table iterator (for use with ht_u64_next).
+hti_u64 ht_u64_iterator(ht_u64* table);
+
+// Move iterator to next item in hash table, update iterator's key
+// and value to current item, and return true. If there are no more
+// items, return false. Don't call ht_u64_set or ht_u64_remove during
+// iteration.
+bool ht_u64_next(hti_u64* it);
+
+#endif // _HT_U64_H
@@ -12,54 +12,111 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <pthread.h>
 #include "set.h"
+#include "hash.h"
 
-#define MAX_FULLNESS_PERCENT 0.25       /* arbitrary */
+#define MIN_KEYS_SIZE 1024              /* first key arena allocation */
+#define SCAN_CHUNK 65536                /* slots per parallel job, multiple of 64 */
+
+/* one input of a parallel set operation: the keys of src that are in other
+   (keep_if SET_TRUE) or not (SET_FALSE), or all of them if other is NULL */
+typedef struct {
+    SimpleSet *src;
+    SimpleSet *other;
+    int keep_if;
+    uint64_t *keep;         /* bitmap over src's slots, filled in by the jobs */
+} set_part;
+
+/* state shared by the jobs of a parallel set operation */
+typedef struct {
+    uint64_t pending;       /* jobs not finished yet */
+    pthread_mutex_t mtx;    /* guards pending */
+    pthread_cond_t done;    /* signalled when pending drops to 0 */
+} set_scan;
+
+/* a range of slots of a part, and the keys it marked */
+typedef struct {
+    set_scan *scan;
+    set_part *part;
+    uint64_t start;
+    uint64_t end;
+    uint64_t count;         /* keys marked */
+    uint64_t bytes;         /* their bytes, NULs included */
+} set_chunk;
 
 /* PRIVATE FUNCTIONS */
 static uint64_t __default_hash(const char *key);
-static int __get_index(SimpleSet *set, const char *key, uint64_t hash, uint64_t *index);
-static int __assign_node(SimpleSet *set, const char *key, uint64_t hash, uint64_t index);
+static int __get_index(SimpleSet *set, const char *key, size_t len, uint64_t hash, uint64_t *index);
+static int __assign_node(SimpleSet *set, const char *key, size_t len, uint64_t hash, uint64_t index);
 static void __free_index(SimpleSet *set, uint64_t index);
 static int __set_contains(SimpleSet *set, const char *key, uint64_t hash);
 static int __set_add(SimpleSet *set, const char *key, uint64_t hash);
-static void __relayout_nodes(SimpleSet *set, uint64_t start, short end_on_null);
+static void __place(simple_set_node *nodes, uint64_t mask, simple_set_node node, uint64_t index);
+static int __resize(SimpleSet *set, uint64_t num_els);
+static void __shift_back(SimpleSet *set, uint64_t hole);
+static void __compact_keys(SimpleSet *set);
+static void __scan_chunk(void *arg);
+static int __set_op_parallel(SimpleSet *res, set_part *parts, int nparts, threadpool pool);
+
+/* key bytes of the node in slot i */
+static __inline__ const char* __node_key(SimpleSet *set, uint64_t i) {
+    return set->keys + set->nodes[i]._key_offset;
+}
 
 /*******************************************************************************
 ***        FUNCTIONS DEFINITIONS
 *******************************************************************************/
 
 int set_init_alt(SimpleSet *set, uint64_t num_els, set_hash_function hash) {
-    set->nodes = (simple_set_node**) malloc(num_els * sizeof(simple_set_node*));
+    return set_init_load(set, num_els, hash, SET_DEFAULT_LOAD);
+}
+
+int set_init_load(SimpleSet *set, uint64_t num_els, set_hash_function hash, float max_load) {
+    if (!(max_load > 0 && max_load <= SET_MAX_LOAD)) {
+        return SET_FALSE;
+    }
+    // slots are picked by masking the hash, so round up to a power of two
+    uint64_t n = 1;
+    while (n < num_els) {
+        n *= 2;
+    }
+    // zero'd, so every slot starts empty
+    set->nodes = (simple_set_node*) calloc(n, sizeof(simple_set_node));
     if (set->nodes == NULL) {
         return SET_MALLOC_ERROR;
     }
-    set->number_nodes = num_els;
-    uint64_t i;
-    for (i = 0; i < set->number_nodes; ++i) {
-        set->nodes[i] = NULL;
-    }
+    set->number_nodes = n;
     set->used_nodes = 0;
+    set->max_load = max_load;
+    set->max_used_nodes = (uint64_t)(n * (double)max_load);
     set->hash_function = (hash == NULL) ? &__default_hash : hash;
+    set->keys = NULL;
+    set->keys_size = 0;
+    set->keys_used = 0;
+    set->keys_dead = 0;
     return SET_TRUE;
 }
 
 int set_clear(SimpleSet *set) {
-    uint64_t i;
-    for(i = 0; i < set->number_nodes; ++i) {
-        if (set->nodes[i] != NULL) {
-            __free_index(set, i);
-        }
-    }
+    memset(set->nodes, 0, set->number_nodes * sizeof(simple_set_node));
     set->used_nodes = 0;
+    set->keys_used = 0;
+    set->keys_dead = 0;
     return SET_TRUE;
 }
 
 int set_destroy(SimpleSet *set) {
-    set_clear(set);
     free(set->nodes);
+    free(set->keys);
+    set->nodes = NULL;
+    set->keys = NULL;
     set->number_nodes = 0;
     set->used_nodes = 0;
+    set->max_used_nodes = 0;
+    set->keys_size = 0;
+    set->keys_used = 0;
+    set->keys_dead = 0;
     set->hash_function = NULL;
     return SET_TRUE;
 }
@@ -71,20 +128,23 @@ int set_add(SimpleSet *set, const char *key) {
 
 int set_contains(SimpleSet *set, const char *key) {
     uint64_t index, hash = set->hash_function(key);
-    return __get_index(set, key, hash, &index);
+    return __get_index(set, key, strlen(key), hash, &index);
 }
 
 int set_remove(SimpleSet *set, const char *key) {
     uint64_t index, hash = set->hash_function(key);
-    int pos = __get_index(set, key, hash, &index);
+    int pos = __get_index(set, key, strlen(key), hash, &index);
     if (pos != SET_TRUE) {
         return pos;
     }
-    // remove this node
+    // remove this node, then close the gap it leaves in its run
     __free_index(set, index);
-    // re-layout nodes
-    __relayout_nodes(set, index, 0);
+    __shift_back(set, index);
     --set->used_nodes;
+    // reclaim the arena once removed keys take up most of it
+    if (set->keys_dead > MIN_KEYS_SIZE && set->keys_dead * 2 > set->keys_used) {
+        __compact_keys(set);
+    }
     return SET_TRUE;
 }
 
@@ -98,16 +158,71 @@ char** set_to_array(SimpleSet *set, uint64_t *size) {
     uint64_t i, j = 0;
     size_t len;
     for (i = 0; i < set->number_nodes; ++i) {
-        if (set->nodes[i] != NULL) {
-            len = strlen(set->nodes[i]->_key);
+        if (set->nodes[i]._dist != 0) {
+            len = set->nodes[i]._key_len;
             results[j] = (char*)calloc(len + 1, sizeof(char));
-            memcpy(results[j], set->nodes[i]->_key, len);
+            memcpy(results[j], __node_key(set, i), len);
             ++j;
         }
     }
     return results;
 }
 
+char* set_to_block(SimpleSet *set, uint64_t **offsets, uint64_t *size) {
+    uint64_t i, j = 0, len = set->keys_used - set->keys_dead;
+    *size = set->used_nodes;
+    *offsets = (uint64_t*)malloc((set->used_nodes + 1) * sizeof(uint64_t));
+    char* block = (char*)malloc(len != 0 ? len : 1);
+    if (*offsets == NULL || block == NULL) {
+        free(*offsets);
+        free(block);
+        *offsets = NULL;
+        return NULL;
+    }
+    if (set->keys_dead == 0 && len != 0) {
+        // the arena holds exactly the live keys: copy it whole, then find
+        // where each key starts with one pass over it
+        memcpy(block, set->keys, len);
+        for (i = 0; i < len; i += strlen(block + i) + 1) {
+            (*offsets)[j++] = i;
+        }
+    } else {
+        // skip removed keys: copy key by key in slot order
+        uint64_t pos = 0;
+        for (i = 0; i < set->number_nodes; ++i) {
+            if (set->nodes[i]._dist != 0) {
+                (*offsets)[j++] = pos;
+                memcpy(block + pos, __node_key(set, i), set->nodes[i]._key_len + 1);
+                pos += set->nodes[i]._key_len + 1;
+            }
+        }
+    }
+    (*offsets)[j] = len;
+    return block;
+}
+
+SimpleSetIterator set_iter(SimpleSet *set) {
+    SimpleSetIterator it;
+    it.key = NULL;
+    it.key_len = 0;
+    it._set = set;
+    it._index = 0;
+    return it;
+}
+
+int set_next(SimpleSetIterator *it) {
+    SimpleSet *set = it->_set;
+    while (it->_index < set->number_nodes) {
+        uint64_t i = it->_index++;
+        if (set->nodes[i]._dist != 0) {
+            it->key = __node_key(set, i);
+            it->key_len = set->nodes[i]._key_len;
+            return SET_TRUE;
+        }
+    }
+    return SET_FALSE;
+}
+
 int set_union(SimpleSet *res, SimpleSet *s1, SimpleSet *s2) {
     if (res->used_nodes != 0) {
         return SET_OCCUPIED_ERROR;
@@ -115,13 +230,13 @@ int set_union(SimpleSet *res, SimpleSet *s1, SimpleSet *s2) {
     // loop over both s1 and s2 and get keys and insert them into res
     uint64_t i;
     for (i = 0; i < s1->number_nodes; ++i) {
-        if (s1->nodes[i] != NULL) {
-            __set_add(res, s1->nodes[i]->_key, s1->nodes[i]->_hash);
+        if (s1->nodes[i]._dist != 0) {
+            __set_add(res, __node_key(s1, i), s1->nodes[i]._hash);
         }
     }
     for (i = 0; i < s2->number_nodes; ++i) {
-        if (s2->nodes[i] != NULL) {
-            __set_add(res, s2->nodes[i]->_key, s2->nodes[i]->_hash);
+        if (s2->nodes[i]._dist != 0) {
+            __set_add(res, __node_key(s2, i), s2->nodes[i]._hash);
         }
     }
     return SET_TRUE;
@@ -131,12 +246,17 @@ int set_intersection(SimpleSet *res, SimpleSet *s1, SimpleSet *s2) {
     if (res->used_nodes != 0) {
         return SET_OCCUPIED_ERROR;
     }
-    // loop over both one of s1 and s2: get keys, check the other, and insert them into res if it is
+    // loop over the smaller of s1 and s2: get keys, check the other, and insert them into res if it is
+    if (s1->used_nodes > s2->used_nodes) {
+        SimpleSet *tmp = s1;
+        s1 = s2;
+        s2 = tmp;
+    }
     uint64_t i;
     for (i = 0; i < s1->number_nodes; ++i) {
-        if (s1->nodes[i] != NULL) {
-            if (__set_contains(s2, s1->nodes[i]->_key, s1->nodes[i]->_hash) == SET_TRUE) {
-                __set_add(res, s1->nodes[i]->_key, s1->nodes[i]->_hash);
+        if (s1->nodes[i]._dist != 0) {
+            if (__set_contains(s2, __node_key(s1, i), s1->nodes[i]._hash) == SET_TRUE) {
+                __set_add(res, __node_key(s1, i), s1->nodes[i]._hash);
             }
         }
     }
@@ -151,9 +271,9 @@ int set_difference(SimpleSet *res, SimpleSet *s1, SimpleSet *s2) {
     // loop over s1 and keep only things not in s2
     uint64_t i;
     for (i = 0; i < s1->number_nodes; ++i) {
-        if (s1->nodes[i] != NULL) {
-            if (__set_contains(s2, s1->nodes[i]->_key, s1->nodes[i]->_hash) != SET_TRUE) {
-                __set_add(res, s1->nodes[i]->_key, s1->nodes[i]->_hash);
+        if (s1->nodes[i]._dist != 0) {
+            if (__set_contains(s2, __node_key(s1, i), s1->nodes[i]._hash) != SET_TRUE) {
+                __set_add(res, __node_key(s1, i), s1->nodes[i]._hash);
             }
         }
     }
@@ -167,17 +287,17 @@ int set_symmetric_difference(SimpleSet *res, SimpleSet *s1, SimpleSet *s2) {
     uint64_t i;
     // loop over set 1 and add elements that are unique to set 1
     for (i = 0; i < s1->number_nodes; ++i) {
-        if (s1->nodes[i] != NULL) {
-            if (__set_contains(s2, s1->nodes[i]->_key, s1->nodes[i]->_hash) != SET_TRUE) {
-                __set_add(res, s1->nodes[i]->_key, s1->nodes[i]->_hash);
+        if (s1->nodes[i]._dist != 0) {
+            if (__set_contains(s2, __node_key(s1, i), s1->nodes[i]._hash) != SET_TRUE) {
+                __set_add(res, __node_key(s1, i), s1->nodes[i]._hash);
             }
         }
     }
     // loop over set 2 and add elements that are unique to set 2
     for (i = 0; i < s2->number_nodes; ++i) {
-        if (s2->nodes[i] != NULL) {
-            if (__set_contains(s1, s2->nodes[i]->_key, s2->nodes[i]->_hash) != SET_TRUE) {
-                __set_add(res, s2->nodes[i]->_key, s2->nodes[i]->_hash);
+        if (s2->nodes[i]._dist != 0) {
+            if (__set_contains(s1, __node_key(s2, i), s2->nodes[i]._hash) != SET_TRUE) {
+                __set_add(res, __node_key(s2, i), s2->nodes[i]._hash);
             }
         }
     }
@@ -187,8 +307,8 @@ int set_symmetric_difference(SimpleSet *res, SimpleSet *s1, SimpleSet *s2) {
 int set_is_subset(SimpleSet *test, SimpleSet *against) {
     uint64_t i;
     for (i = 0; i < test->number_nodes; ++i) {
-        if (test->nodes[i] != NULL) {
-            if (__set_contains(against, test->nodes[i]->_key, test->nodes[i]->_hash) == SET_FALSE) {
+        if (test->nodes[i]._dist != 0) {
+            if (__set_contains(against, __node_key(test, i), test->nodes[i]._hash) == SET_FALSE) {
                 return SET_FALSE;
             }
         }
@@ -211,8 +331,8 @@ int set_cmp(SimpleSet *left, SimpleSet *right) {
     }
     uint64_t i;
     for (i = 0; i < left->number_nodes; ++i) {
-        if (left->nodes[i] != NULL) {
-            if (set_contains(right, left->nodes[i]->_key) != SET_TRUE) {
+        if (left->nodes[i]._dist != 0) {
+            if (set_contains(right, __node_key(left, i)) != SET_TRUE) {
                 return SET_UNEQUAL;
             }
         }
@@ -221,104 +341,307 @@ int set_cmp(SimpleSet *left, SimpleSet *right) {
     return SET_EQUAL;
 }
 
+int set_union_parallel(SimpleSet *res, SimpleSet *s1, SimpleSet *s2, threadpool pool) {
+    // all of s1, then what s2 adds to it
+    set_part parts[2] = {{s1, NULL, SET_TRUE, NULL}, {s2, s1, SET_FALSE, NULL}};
+    return __set_op_parallel(res, parts, 2, pool);
+}
+
+int set_intersection_parallel(SimpleSet *res, SimpleSet *s1, SimpleSet *s2, threadpool pool) {
+    // scan the smaller set, look up in the larger
+    set_part part = {s1, s2, SET_TRUE, NULL};
+    if (s1->used_nodes > s2->used_nodes) {
+        part.src = s2;
+        part.other = s1;
+    }
+    return __set_op_parallel(res, &part, 1, pool);
+}
+
+int set_difference_parallel(SimpleSet *res, SimpleSet *s1, SimpleSet *s2, threadpool pool) {
+    set_part part = {s1, s2, SET_FALSE, NULL};
+    return __set_op_parallel(res, &part, 1, pool);
+}
+
+int set_symmetric_difference_parallel(SimpleSet *res, SimpleSet *s1, SimpleSet *s2, threadpool pool) {
+    set_part parts[2] = {{s1, s2, SET_FALSE, NULL}, {s2, s1, SET_FALSE, NULL}};
+    return __set_op_parallel(res, parts, 2, pool);
+}
+
 
 /*******************************************************************************
 ***        PRIVATE FUNCTIONS
 *******************************************************************************/
 static uint64_t __default_hash(const char *key) {
-    // FNV-1a hash (http://www.isthe.com/chongo/tech/comp/fnv/)
-    size_t i, len = strlen(key);
-    uint64_t h = 14695981039346656037ULL; // FNV_OFFSET 64 bit
-    for (i = 0; i < len; ++i) {
-        h = h ^ (unsigned char) key[i];
-        h = h * 1099511628211ULL; // FNV_PRIME 64 bit
-    }
-    return h;
+    // word-at-a-time hash shared with ht (see hash.h)
+    return hash_wyhash(key, strlen(key), 0);
 }
 
 static int __set_contains(SimpleSet *set, const char *key, uint64_t hash) {
     uint64_t index;
-    return __get_index(set, key, hash, &index);
+    return __get_index(set, key, strlen(key), hash, &index);
 }
 
 static int __set_add(SimpleSet *set, const char *key, uint64_t hash) {
     uint64_t index;
-    if (__set_contains(set, key, hash) == SET_TRUE)
+    size_t len = strlen(key);
+    if (__get_index(set, key, len, hash, &index) == SET_TRUE)
         return SET_ALREADY_PRESENT;
 
     // Expand nodes if we are close to our desired fullness
-    if ((float)set->used_nodes / set->number_nodes > MAX_FULLNESS_PERCENT) {
-        uint64_t num_els = set->number_nodes * 2; // we want to double each time
-        simple_set_node** tmp = (simple_set_node**)realloc(set->nodes, num_els * sizeof(simple_set_node*));
-        if (tmp == NULL || set->nodes == NULL) // malloc failure
+    if (set->used_nodes >= set->max_used_nodes) {
+        // we want to double each time (more for a tiny set at a low load)
+        uint64_t num_els = set->number_nodes * 2;
+        while ((uint64_t)(num_els * (double)set->max_load) <= set->used_nodes)
+            num_els *= 2;
+        if (__resize(set, num_els) != SET_TRUE) // malloc failure
             return SET_MALLOC_ERROR;
-
-        set->nodes = tmp;
-        uint64_t i, orig_num_els = set->number_nodes;
-        for (i = orig_num_els; i < num_els; ++i)
-            set->nodes[i] = NULL;
-
-        set->number_nodes = num_els;
-        // re-layout all nodes
-        __relayout_nodes(set, 0, 1);
     }
     // add element in
-    int res = __get_index(set, key, hash, &index);
+    int res = __get_index(set, key, len, hash, &index);
     if (res == SET_FALSE) { // this is the first open slot
-        __assign_node(set, key, hash, index);
-        ++set->used_nodes;
-        return SET_TRUE;
+        res = __assign_node(set, key, len, hash, index);
+        if (res == SET_TRUE)
+            ++set->used_nodes;
     }
     return res;
 }
 
-static int __get_index(SimpleSet *set, const char *key, uint64_t hash, uint64_t *index) {
-    uint64_t i, idx;
-    idx = hash % set->number_nodes;
-    i = idx;
-    size_t len = strlen(key);
-    while (1) {
-        if (set->nodes[i] == NULL) {
+/* Robin Hood lookup: nodes in a run are ordered by distance from home, so
+   the search stops at the first node closer to its home than the key would
+   be (or an empty slot); on SET_FALSE index is where the key would go */
+static int __get_index(SimpleSet *set, const char *key, size_t len, uint64_t hash, uint64_t *index) {
+    uint64_t mask = set->number_nodes - 1;
+    uint64_t i = hash & mask;
+    uint64_t dist;
+    for (dist = 1; dist <= set->number_nodes; ++dist) {
+        simple_set_node *node = &set->nodes[i];
+        if (node->_dist < dist) {
             *index = i;
-            return SET_FALSE; // not here OR first open slot
-        } else if (hash == set->nodes[i]->_hash && len == strlen(set->nodes[i]->_key) && strncmp(key, set->nodes[i]->_key, len) == 0) {
+            return SET_FALSE; // not here
+        } else if (hash == node->_hash && len == node->_key_len && memcmp(key, set->keys + node->_key_offset, len) == 0) {
             *index = i;
             return SET_TRUE;
         }
-        ++i;
-        if (i == set->number_nodes)
-            i = 0;
-        if (i == idx) // this means we went all the way around and the set is full
-            return SET_CIRCULAR_ERROR;
+        i = (i + 1) & mask;
     }
+    // this means we went all the way around and the set is full
+    return SET_CIRCULAR_ERROR;
 }
 
-static int __assign_node(SimpleSet *set, const char *key, uint64_t hash, uint64_t index) {
-    size_t len = strlen(key);
-    set->nodes[index] = (simple_set_node*)malloc(sizeof(simple_set_node));
-    set->nodes[index]->_key = (char*)calloc(len + 1, sizeof(char));
-    memcpy(set->nodes[index]->_key, key, len);
-    set->nodes[index]->_hash = hash;
+/* append key (and its NUL) to the arena and insert a node for it at index,
+   as found by __get_index */
+static int __assign_node(SimpleSet *set, const char *key, size_t len, uint64_t hash, uint64_t index) {
+    if (len > UINT32_MAX)
+        return SET_MALLOC_ERROR;
+    if (set->keys_size - set->keys_used < len + 1) {
+        uint64_t size = set->keys_size < MIN_KEYS_SIZE ? MIN_KEYS_SIZE : set->keys_size;
+        while (size - set->keys_used < len + 1)
+            size *= 2;
+        char* tmp = (char*)realloc(set->keys, size);
+        if (tmp == NULL) // malloc failure
+            return SET_MALLOC_ERROR;
+        set->keys = tmp;
+        set->keys_size = size;
+    }
+    memcpy(set->keys + set->keys_used, key, len);
+    set->keys[set->keys_used + len] = '\0';
+    simple_set_node node;
+    uint64_t mask = set->number_nodes - 1;
+    node._hash = hash;
+    node._key_offset = set->keys_used;
+    node._key_len = (uint32_t)len;
+    node._dist = (uint32_t)(((index - hash) & mask) + 1);
+    __place(set->nodes, mask, node, index);
+    set->keys_used += len + 1;
     return SET_TRUE;
 }
 
+/* empty the slot; its key bytes stay in the arena until it's compacted */
 static void __free_index(SimpleSet *set, uint64_t index) {
-    free(set->nodes[index]->_key);
-    free(set->nodes[index]);
-    set->nodes[index] = NULL;
-}
-
-static void __relayout_nodes(SimpleSet *set, uint64_t start, short end_on_null) {
-    uint64_t index = 0, i;
-    for (i = start; i < set->number_nodes; ++i) {
-        if(set->nodes[i] != NULL) {
-            __get_index(set, set->nodes[i]->_key, set->nodes[i]->_hash, &index);
-            if (i != index) { // we are moving this node
-                __assign_node(set, set->nodes[i]->_key, set->nodes[i]->_hash, index);
-                __free_index(set, i);
+    set->keys_dead += set->nodes[index]._key_len + 1;
+    set->nodes[index]._dist = 0;
+}
+
+/* Robin Hood insert of node, whose _dist is right for index: take the slot
+   from any node nearer its home, which then moves on to find one itself */
+static void __place(simple_set_node *nodes, uint64_t mask, simple_set_node node, uint64_t index) {
+    while (nodes[index]._dist != 0) {
+        if (nodes[index]._dist < node._dist) {
+            simple_set_node tmp = nodes[index];
+            nodes[index] = node;
+            node = tmp;
+        }
+        index = (index + 1) & mask;
+        ++node._dist;
+    }
+    nodes[index] = node;
+}
+
+/* rehash the slots into a fresh array of num_els slots: each record is
+   placed by its cached hash and copied, keys stay put in the arena */
+static int __resize(SimpleSet *set, uint64_t num_els) {
+    simple_set_node *nodes = (simple_set_node*)calloc(num_els, sizeof(simple_set_node));
+    if (nodes == NULL)
+        return SET_MALLOC_ERROR;
+    uint64_t i, mask = num_els - 1;
+    for (i = 0; i < set->number_nodes; ++i) {
+        if (set->nodes[i]._dist != 0) {
+            simple_set_node node = set->nodes[i];
+            node._dist = 1;
+            __place(nodes, mask, node, node._hash & mask);
+        }
+    }
+    free(set->nodes);
+    set->nodes = nodes;
+    set->number_nodes = num_els;
+    set->max_used_nodes = (uint64_t)(num_els * (double)set->max_load);
+    return SET_TRUE;
+}
+
+/* backward-shift deletion: move the rest of the run back a slot, up to an
+   empty slot or a node already in its home slot, so lookups never stop
+   early at the gap and no tombstones are needed */
+static void __shift_back(SimpleSet *set, uint64_t hole) {
+    uint64_t mask = set->number_nodes - 1;
+    uint64_t i = (hole + 1) & mask;
+    while (set->nodes[i]._dist > 1) {
+        set->nodes[hole] = set->nodes[i];
+        --set->nodes[hole]._dist;
+        set->nodes[i]._dist = 0;
+        hole = i;
+        i = (i + 1) & mask;
+    }
+}
+
+/* copy the live keys into a fresh arena, dropping the removed ones; if
+   that can't be allocated, keep the old one */
+static void __compact_keys(SimpleSet *set) {
+    uint64_t i, used = 0, size = set->keys_used - set->keys_dead;
+    if (size < MIN_KEYS_SIZE)
+        size = MIN_KEYS_SIZE;
+    char* keys = (char*)malloc(size);
+    if (keys == NULL)
+        return;
+    for (i = 0; i < set->number_nodes; ++i) {
+        if (set->nodes[i]._dist != 0) {
+            memcpy(keys + used, __node_key(set, i), set->nodes[i]._key_len + 1);
+            set->nodes[i]._key_offset = used;
+            used += set->nodes[i]._key_len + 1;
+        }
+    }
+    free(set->keys);
+    set->keys = keys;
+    set->keys_size = size;
+    set->keys_used = used;
+    set->keys_dead = 0;
+}
+
+/* mark the keys of a chunk that belong in the result; runs on a pool thread.
+   Chunks cover whole words of the bitmap, so no two write the same one */
+static void __scan_chunk(void *arg) {
+    set_chunk *chunk = (set_chunk*)arg;
+    set_part *part = chunk->part;
+    SimpleSet *src = part->src;
+    uint64_t i, index;
+    for (i = chunk->start; i < chunk->end; ++i) {
+        if (src->nodes[i]._dist != 0) {
+            if (part->other == NULL || __get_index(part->other, __node_key(src, i), src->nodes[i]._key_len, src->nodes[i]._hash, &index) == part->keep_if) {
+                part->keep[i / 64] |= (uint64_t)1 << (i % 64);
+                ++chunk->count;
+                chunk->bytes += src->nodes[i]._key_len + 1;
+            }
+        }
+    }
+
+    pthread_mutex_lock(&chunk->scan->mtx);
+    if (--chunk->scan->pending == 0)
+        pthread_cond_signal(&chunk->scan->done);
+    pthread_mutex_unlock(&chunk->scan->mtx);
+}
+
+/* scan the parts in chunks on pool, then size res once for the marked keys
+   and copy them in; they're distinct, so each is placed without a lookup */
+static int __set_op_parallel(SimpleSet *res, set_part *parts, int nparts, threadpool pool) {
+    if (res->used_nodes != 0) {
+        return SET_OCCUPIED_ERROR;
+    }
+    uint64_t i, c, nchunks = 0, count = 0, bytes = 0;
+    int p, ret = SET_MALLOC_ERROR;
+    for (p = 0; p < nparts; ++p) {
+        nchunks += (parts[p].src->number_nodes + SCAN_CHUNK - 1) / SCAN_CHUNK;
+    }
+    set_chunk *chunks = (set_chunk*)calloc(nchunks, sizeof(set_chunk));
+    set_scan scan = {nchunks, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+    for (p = 0; p < nparts; ++p) {
+        parts[p].keep = (uint64_t*)calloc((parts[p].src->number_nodes + 63) / 64, sizeof(uint64_t));
+    }
+    if (chunks == NULL)
+        goto done;
+    for (p = 0; p < nparts; ++p) {
+        if (parts[p].keep == NULL)
+            goto done;
+    }
+
+    // split each part's slots into chunks, run them, and wait
+    c = 0;
+    for (p = 0; p < nparts; ++p) {
+        for (i = 0; i < parts[p].src->number_nodes; i += SCAN_CHUNK) {
+            chunks[c].scan = &scan;
+            chunks[c].part = &parts[p];
+            chunks[c].start = i;
+            chunks[c].end = parts[p].src->number_nodes - i < SCAN_CHUNK ? parts[p].src->number_nodes : i + SCAN_CHUNK;
+            ++c;
+        }
+    }
+    for (c = 0; c < nchunks; ++c) {
+        // if the pool won't take the job, run it here
+        if (thpool_add_work(pool, __scan_chunk, &chunks[c]) != 0)
+            __scan_chunk(&chunks[c]);
+    }
+    pthread_mutex_lock(&scan.mtx);
+    while (scan.pending != 0)
+        pthread_cond_wait(&scan.done, &scan.mtx);
+    pthread_mutex_unlock(&scan.mtx);
+
+    // grow res (slots and arena) once to hold every marked key
+    for (c = 0; c < nchunks; ++c) {
+        count += chunks[c].count;
+        bytes += chunks[c].bytes;
+    }
+    uint64_t num_els = res->number_nodes;
+    while ((uint64_t)(num_els * (double)res->max_load) < count)
+        num_els *= 2;
+    if (num_els != res->number_nodes && __resize(res, num_els) != SET_TRUE)
+        goto done;
+    if (res->keys_size - res->keys_used < bytes) {
+        char *keys = (char*)realloc(res->keys, res->keys_used + bytes);
+        if (keys == NULL)
+            goto done;
+        res->keys = keys;
+        res->keys_size = res->keys_used + bytes;
+    }
+
+    // then copy the keys in, in slot order
+    for (p = 0; p < nparts; ++p) {
+        SimpleSet *src = parts[p].src;
+        for (i = 0; i < src->number_nodes; i += 64) {
+            uint64_t word;
+            for (word = parts[p].keep[i / 64]; word != 0; word &= word - 1) {
+                uint64_t j = i + (uint64_t)__builtin_ctzll(word);
+                __assign_node(res, __node_key(src, j), src->nodes[j]._key_len, src->nodes[j]._hash, src->nodes[j]._hash & (res->number_nodes - 1));
             }
-        } else if (end_on_null == 0 && i != start) {
-            break;
         }
     }
+    res->used_nodes = count;
+    ret = SET_TRUE;
+
+done:
+    for (p = 0; p < nparts; ++p) {
+        free(parts[p].keep);
+        parts[p].keep = NULL;
+    }
+    free(chunks);
+    pthread_cond_destroy(&scan.done);
+    pthread_mutex_destroy(&scan.mtx);
+    return ret;
 }
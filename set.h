@@ -20,6 +20,8 @@ extern "C" {
 
 #include <inttypes.h>       /* uint64_t */
 
+#include "thpool.h"
+
 
 /* https://gcc.gnu.org/onlinedocs/gcc/Alternate-Keywords.html#Alternate-Keywords */
 #ifndef __GNUC__
@@ -28,36 +30,60 @@ extern "C" {
 
 typedef uint64_t (*set_hash_function) (const char *key);
 
+/*  A slot of the set; the key bytes (NUL-terminated) live in the set's key
+    arena at _key_offset, so a probe only reads the key if the hash and
+    length already match */
 typedef struct  {
-    char* _key;
     uint64_t _hash;
+    uint64_t _key_offset;
+    uint32_t _key_len;
+    uint32_t _dist;         /* 1 + distance from home slot, 0 if empty */
 } SimpleSetNode, simple_set_node;
 
 typedef struct  {
-    simple_set_node **nodes;
-    uint64_t number_nodes;
+    simple_set_node *nodes;
+    uint64_t number_nodes;  /* power of two */
     uint64_t used_nodes;
+    uint64_t max_used_nodes;  /* grow before used_nodes exceeds this */
+    float max_load;
     set_hash_function hash_function;
+    char *keys;             /* key arena, one allocation for all keys */
+    uint64_t keys_size;     /* bytes allocated */
+    uint64_t keys_used;     /* bytes appended, including removed keys */
+    uint64_t keys_dead;     /* bytes of removed keys */
 } SimpleSet, simple_set;
 
 
 
 /*  Initialize the set either with default parameters (hash function and space)
-    or optionally set the set with specifed values
+    or optionally set the set with specifed values; num_els is rounded up to a
+    power of two
 
     Returns:
         SET_MALLOC_ERROR: If an error occured setting up the memory
         SET_TRUE: On success
 */
 int set_init_alt(SimpleSet *set, uint64_t num_els, set_hash_function hash);
+
+/*  Same as set_init_alt, also setting the fraction of slots that may be
+    used before the set doubles (set_init_alt uses SET_DEFAULT_LOAD). Robin
+    Hood probing keeps probe runs short even at 0.8 to 0.9, which needs under
+    a third of the slots of the default
+
+    Returns:
+        SET_MALLOC_ERROR: If an error occured setting up the memory
+        SET_FALSE: If max_load is not in (0, SET_MAX_LOAD]
+        SET_TRUE: On success
+*/
+int set_init_load(SimpleSet *set, uint64_t num_els, set_hash_function hash, float max_load);
 static __inline__ int set_init(SimpleSet *set) {
     return set_init_alt(set, 1024, NULL);
 }
 
-/* Utility function to clear out the set */
+/* Utility function to clear out the set; keeps its memory for reuse */
 int set_clear(SimpleSet *set);
 
-/* Free all memory that is part of the set */
+/* Free all memory that is part of the set, keys included in one go */
 int set_destroy(SimpleSet *set);
 
 /*  Add element to set
@@ -105,6 +131,7 @@ int set_union(SimpleSet *res, SimpleSet *s1, SimpleSet *s2);
 
     The intersection of a set A with a B is the set of elements that are in
     both set A and B. The intersection is denoted as A ∩ B
+    NOTE: Iterates the smaller of s1 and s2, looking each key up in the other
 */
 int set_intersection(SimpleSet *res, SimpleSet *s1, SimpleSet *s2);
 
@@ -127,6 +154,24 @@ int set_difference(SimpleSet *res, SimpleSet *s1, SimpleSet *s2);
 */
 int set_symmetric_difference(SimpleSet *res, SimpleSet *s1, SimpleSet *s2);
 
+/*  Parallel versions of set_union, set_intersection, set_difference and
+    set_symmetric_difference for large sets: the slots of the inputs are
+    split into ranges scanned by jobs on pool, each marking which of its keys
+    belong in res; then res is grown once to fit them all and filled on the
+    calling thread, with no lookups as the marked keys are all distinct.
+    s1, s2 and res must use the same hash function. Must not be called from
+    a job running on pool.
+
+    Returns:
+        SET_TRUE on success
+        SET_OCCUPIED_ERROR if res is not empty
+        SET_MALLOC_ERROR if out of memory (res is left empty)
+*/
+int set_union_parallel(SimpleSet *res, SimpleSet *s1, SimpleSet *s2, threadpool pool);
+int set_intersection_parallel(SimpleSet *res, SimpleSet *s1, SimpleSet *s2, threadpool pool);
+int set_difference_parallel(SimpleSet *res, SimpleSet *s1, SimpleSet *s2, threadpool pool);
+int set_symmetric_difference_parallel(SimpleSet *res, SimpleSet *s1, SimpleSet *s2, threadpool pool);
+
 /*  Return SET_TRUE if test is fully contained in s2; returns SET_FALSE
     otherwise
     test ⊆ against
@@ -173,9 +218,38 @@ static __inline__ int set_is_superset_strict(SimpleSet *test, SimpleSet *against
 }
 
 /*  Return an array of the elements in the set
-    NOTE: Up to the caller to free the memory */
+    NOTE: Up to the caller to free the memory; set_to_block and set_iter
+    avoid allocating per element */
 char** set_to_array(SimpleSet *set, uint64_t *size);
 
+/*  Return all elements of the set in one block, each NUL-terminated, back
+    to back and in no particular order; set *offsets to an array of *size + 1
+    entries where element i starts at block + (*offsets)[i] and the last
+    entry is the block's length
+    NOTE: Up to the caller to free the block and *offsets; returns NULL if
+    out of memory */
+char* set_to_block(SimpleSet *set, uint64_t **offsets, uint64_t *size);
+
+/*  Iterator over the elements of a set: create with set_iter, then call
+    set_next until it returns SET_FALSE. key points into the set's own
+    memory: it's valid until the set is next modified and must not be freed */
+typedef struct {
+    const char *key;        /* current element, NUL-terminated */
+    uint64_t key_len;
+    SimpleSet *_set;
+    uint64_t _index;        /* next slot to look at */
+} SimpleSetIterator, simple_set_iterator;
+
+SimpleSetIterator set_iter(SimpleSet *set);
+
+/*  Move iterator to the next element, update key and key_len
+
+    Returns:
+        SET_TRUE if moved to an element
+        SET_FALSE if there are no more elements
+*/
+int set_next(SimpleSetIterator *it);
+
 /*  Compare two sets for equality (size, keys same, etc)
 
     Returns:
@@ -188,6 +262,9 @@ int set_cmp(SimpleSet *left, SimpleSet *right);
 
 // void set_printf(SimpleSet *set);                                           /* TODO: implement */
 
+#define SET_DEFAULT_LOAD 0.25f
+#define SET_MAX_LOAD 0.95f
+
 #define SET_TRUE 0
 #define SET_FALSE -1
 #define SET_MALLOC_ERROR -2